@@ -39,6 +39,364 @@
 using namespace std;
 #endif /* __PROGTEST__ */
 
+//-------------------------------------------------------------------------------------------------------------------------------------------------------------
+/**
+ * @brief: Decides which pairs of vertices can be connected by a diagonal
+ * @note: Cells are grouped by interval length (j - i), each length has its own bitmap,
+ * so the DP tables can be packed by length and skip the cells that can never be used
+ */
+class CDiagonals {
+private:
+	size_t m_n;
+	int m_orientation;
+	vector<vector<uint64_t>> m_bits;  // m_bits[len][i / 64], bit i is set when (i, i + len) is usable
+	vector<vector<uint32_t>> m_ranks; // m_ranks[len][w] = usable cells of this length before word w
+	vector<size_t> m_counts;
+
+	static long long cross(const CPoint &a, const CPoint &b, const CPoint &c) {
+		return (long long)(b.m_X - a.m_X) * (c.m_Y - a.m_Y) - (long long)(b.m_Y - a.m_Y) * (c.m_X - a.m_X);
+	}
+	static bool between(const CPoint &a, const CPoint &b, const CPoint &c) {
+		// c is collinear with a-b, is it on the closed segment?
+		if (a.m_X != b.m_X)
+			return (a.m_X <= c.m_X && c.m_X <= b.m_X) || (b.m_X <= c.m_X && c.m_X <= a.m_X);
+		return (a.m_Y <= c.m_Y && c.m_Y <= b.m_Y) || (b.m_Y <= c.m_Y && c.m_Y <= a.m_Y);
+	}
+	static bool intersect(const CPoint &a, const CPoint &b, const CPoint &c, const CPoint &d) {
+		long long abc = cross(a, b, c), abd = cross(a, b, d), cda = cross(c, d, a), cdb = cross(c, d, b);
+		if (((abc > 0 && abd < 0) || (abc < 0 && abd > 0)) && ((cda > 0 && cdb < 0) || (cda < 0 && cdb > 0)))
+			return true;
+		return (abc == 0 && between(a, b, c)) || (abd == 0 && between(a, b, d)) || (cda == 0 && between(c, d, a)) || (cdb == 0 && between(c, d, b));
+	}
+
+	// orientation corrected cross product, > 0 means c is left of a->b in a counter-clockwise polygon
+	long long left(const CPoint &a, const CPoint &b, const CPoint &c) const {
+		return m_orientation * cross(a, b, c);
+	}
+
+	bool inCone(const vector<CPoint> &p, size_t a, size_t b) const {
+		const CPoint &prev = p[(a + m_n - 1) % m_n], &next = p[(a + 1) % m_n];
+		if (left(p[a], next, prev) >= 0) // convex vertex
+			return left(p[a], p[b], prev) > 0 && left(p[b], p[a], next) > 0;
+		return !(left(p[a], p[b], next) >= 0 && left(p[b], p[a], prev) >= 0);
+	}
+
+	bool isDiagonal(const vector<CPoint> &p, size_t a, size_t b) const {
+		if (!inCone(p, a, b) || !inCone(p, b, a))
+			return false;
+		for (size_t e = 0; e < m_n; ++e) {
+			size_t f = (e + 1) % m_n;
+			if (e == a || e == b || f == a || f == b)
+				continue;
+			if (intersect(p[a], p[b], p[e], p[f]))
+				return false;
+		}
+		return true;
+	}
+
+public:
+	CDiagonals(const vector<CPoint> &points) : m_n(points.size()), m_orientation(1), m_bits(m_n), m_ranks(m_n), m_counts(m_n, 0) {
+		long long area = 0;
+		for (size_t i = 0; i < m_n; ++i)
+			area += cross(CPoint(0, 0), points[i], points[(i + 1) % m_n]);
+		if (area < 0)
+			m_orientation = -1;
+
+		for (size_t len = 1; len < m_n; ++len) {
+			size_t cells = m_n - len;
+			m_bits[len].assign((cells + 63) / 64, 0);
+			m_ranks[len].assign(m_bits[len].size(), 0);
+			for (size_t i = 0; i < cells; ++i) {
+				size_t j = i + len;
+				if (len == 1 || (i == 0 && j == m_n - 1) || isDiagonal(points, i, j))
+					m_bits[len][i / 64] |= uint64_t(1) << (i % 64);
+			}
+			uint32_t sum = 0;
+			for (size_t w = 0; w < m_bits[len].size(); ++w) {
+				m_ranks[len][w] = sum;
+				sum += __builtin_popcountll(m_bits[len][w]);
+			}
+			m_counts[len] = sum;
+		}
+	}
+
+	size_t size() const {
+		return m_n;
+	}
+
+	/**
+	 * @returns: True when i and j (i < j) are neighbours or can be connected by a diagonal
+	 */
+	bool isUsable(size_t i, size_t j) const {
+		size_t len = j - i;
+		return (m_bits[len][i / 64] >> (i % 64)) & 1;
+	}
+
+	/**
+	 * @returns: Position of usable cell (i, i + len) among the usable cells of the same length
+	 */
+	size_t rank(size_t i, size_t len) const {
+		uint64_t mask = (uint64_t(1) << (i % 64)) - 1;
+		return m_ranks[len][i / 64] + __builtin_popcountll(m_bits[len][i / 64] & mask);
+	}
+
+	size_t countByLength(size_t len) const {
+		return m_counts[len];
+	}
+
+	size_t memoryUsage() const {
+		size_t total = 0;
+		for (size_t len = 1; len < m_n; ++len)
+			total += m_bits[len].size() * sizeof(uint64_t) + m_ranks[len].size() * sizeof(uint32_t);
+		return total;
+	}
+};
+
+/**
+ * @brief: Upper triangle of a DP table packed by interval length, holds only the usable cells
+ * @note: Cells of length 1 (polygon sides) are not stored, the caller knows their value
+ */
+template <typename T_>
+class CPackedTable {
+private:
+	const CDiagonals &m_diag;
+	vector<size_t> m_base;
+	vector<T_> m_data;
+
+public:
+	CPackedTable(const CDiagonals &diag) : m_diag(diag), m_base(diag.size() + 1, 0) {
+		size_t cells = 0;
+		for (size_t len = 2; len < diag.size(); ++len) {
+			m_base[len] = cells;
+			cells += diag.countByLength(len);
+		}
+		m_data.resize(cells);
+	}
+
+	// (i, j) has to be usable and j - i >= 2
+	T_ &at(size_t i, size_t j) {
+		return m_data[m_base[j - i] + m_diag.rank(i, j - i)];
+	}
+
+	size_t memoryUsage() const {
+		return m_data.size() * sizeof(T_) + m_base.size() * sizeof(size_t);
+	}
+
+	/**
+	 * @returns: Upper bound of the memory needed for a polygon with n vertices, before the diagonals are known
+	 */
+	static size_t memoryBound(size_t n) {
+		size_t cells = n < 3 ? 0 : (n - 1) * (n - 2) / 2;
+		size_t words = 0;
+		for (size_t len = 1; len < n; ++len)
+			words += (n - len + 63) / 64;
+		return cells * sizeof(T_) + (n + 1) * sizeof(size_t) + words * (sizeof(uint64_t) + sizeof(uint32_t));
+	}
+};
+
+/**
+ * @brief: Own TriangCnt solver with the same interface as the progtest one
+ */
+class CCntSolver : public CProgtestSolver {
+private:
+	size_t m_capacity;
+	vector<APolygon> m_polygons;
+	bool m_solved;
+	size_t m_peakMemory;
+
+public:
+	CCntSolver(size_t capacity = 1) : m_capacity(capacity), m_solved(false), m_peakMemory(0) {}
+
+	bool hasFreeCapacity() const override {
+		return m_polygons.size() < m_capacity;
+	}
+	bool addPolygon(APolygon p) override {
+		if (!hasFreeCapacity())
+			return false;
+		m_polygons.push_back(p);
+		return true;
+	}
+	size_t solve() override {
+		if (m_solved)
+			return 0;
+		m_solved = true;
+		for (auto &polygon : m_polygons)
+			solveOne(*polygon);
+		return m_polygons.size();
+	}
+
+	/**
+	 * @returns: The biggest DP footprint (table + bitmaps) seen by this solver, in bytes
+	 */
+	size_t peakMemory() const {
+		return m_peakMemory;
+	}
+
+	static size_t memoryBound(size_t vertices) {
+		return CPackedTable<CBigInt>::memoryBound(vertices);
+	}
+
+	void solveOne(CPolygon &polygon) {
+		size_t n = polygon.m_Points.size();
+		if (n < 3) {
+			polygon.m_TriangCnt = 0;
+			return;
+		}
+		CDiagonals diag(polygon.m_Points);
+		CPackedTable<CBigInt> cnt(diag);
+		m_peakMemory = max(m_peakMemory, diag.memoryUsage() + cnt.memoryUsage());
+
+		for (size_t len = 2; len < n; ++len) {
+			for (size_t i = 0; i + len < n; ++i) {
+				size_t j = i + len;
+				if (!diag.isUsable(i, j))
+					continue;
+				CBigInt sum;
+				for (size_t k = i + 1; k < j; ++k) {
+					if (!diag.isUsable(i, k) || !diag.isUsable(k, j))
+						continue;
+					if (k == i + 1 && k + 1 == j)
+						sum += CBigInt(1);
+					else if (k == i + 1)
+						sum += cnt.at(k, j);
+					else if (k + 1 == j)
+						sum += cnt.at(i, k);
+					else
+						sum += cnt.at(i, k) * cnt.at(k, j);
+				}
+				cnt.at(i, j) = sum;
+			}
+		}
+		polygon.m_TriangCnt = cnt.at(0, n - 1);
+	}
+};
+
+constexpr size_t MIN_LANES = 8;
+constexpr size_t MIN_BATCH_VERTICES = 30;
+typedef double TMinLanes __attribute__((vector_size(MIN_LANES * sizeof(double))));
+
+/**
+ * @brief: Own TriangMin solver with the same interface as the progtest one
+ * @note: Polygons smaller than MIN_BATCH_VERTICES are grouped by vertex count and solved MIN_LANES at a time,
+ * one polygon per SIMD lane, bigger polygons go through the packed table one by one
+ */
+class CMinSolver : public CProgtestSolver {
+private:
+	size_t m_capacity;
+	vector<APolygon> m_polygons;
+	bool m_solved;
+
+	static double distance(const CPoint &a, const CPoint &b) {
+		return hypot((double)a.m_X - b.m_X, (double)a.m_Y - b.m_Y);
+	}
+
+	static double perimeter(const vector<CPoint> &points) {
+		double sum = 0;
+		for (size_t i = 0; i < points.size(); ++i)
+			sum += distance(points[i], points[(i + 1) % points.size()]);
+		return sum;
+	}
+
+	/**
+	 * @brief: Solves up to MIN_LANES polygons with the same vertex count at once
+	 * @note: Cell (i, j) holds the cheapest triangulation of i..j plus the length of diagonal i-j,
+	 * unusable diagonals are infinite, so every lane runs the same branch-free loop
+	 */
+	static void solveLanes(vector<CPolygon *> &group, size_t n) {
+		vector<TMinLanes> cost(n * n), weight(n * n);
+		for (size_t lane = 0; lane < group.size(); ++lane) {
+			const vector<CPoint> &points = group[lane]->m_Points;
+			CDiagonals diag(points);
+			for (size_t len = 2; len < n; ++len)
+				for (size_t i = 0; i + len < n; ++i) {
+					size_t j = i + len;
+					if (!diag.isUsable(i, j))
+						weight[i * n + j][lane] = HUGE_VAL;
+					else if (len != n - 1)
+						weight[i * n + j][lane] = distance(points[i], points[j]);
+				}
+		}
+
+		for (size_t len = 2; len < n; ++len)
+			for (size_t i = 0; i + len < n; ++i) {
+				size_t j = i + len;
+				TMinLanes best = cost[i * n + i + 1] + cost[(i + 1) * n + j];
+				for (size_t k = i + 2; k < j; ++k) {
+					TMinLanes split = cost[i * n + k] + cost[k * n + j];
+					best = split < best ? split : best;
+				}
+				cost[i * n + j] = best + weight[i * n + j];
+			}
+
+		for (size_t lane = 0; lane < group.size(); ++lane)
+			group[lane]->m_TriangMin = cost[n - 1][lane] + perimeter(group[lane]->m_Points);
+	}
+
+public:
+	CMinSolver(size_t capacity = 1) : m_capacity(capacity), m_solved(false) {}
+
+	bool hasFreeCapacity() const override {
+		return m_polygons.size() < m_capacity;
+	}
+	bool addPolygon(APolygon p) override {
+		if (!hasFreeCapacity())
+			return false;
+		m_polygons.push_back(p);
+		return true;
+	}
+	size_t solve() override {
+		if (m_solved)
+			return 0;
+		m_solved = true;
+
+		vector<vector<CPolygon *>> groups(MIN_BATCH_VERTICES);
+		for (auto &polygon : m_polygons) {
+			size_t n = polygon->m_Points.size();
+			if (n < 3 || n >= MIN_BATCH_VERTICES) {
+				solveOne(*polygon);
+				continue;
+			}
+			groups[n].push_back(polygon.get());
+			if (groups[n].size() == MIN_LANES) {
+				solveLanes(groups[n], n);
+				groups[n].clear();
+			}
+		}
+		for (size_t n = 0; n < groups.size(); ++n)
+			if (!groups[n].empty())
+				solveLanes(groups[n], n);
+		return m_polygons.size();
+	}
+
+	static void solveOne(CPolygon &polygon) {
+		size_t n = polygon.m_Points.size();
+		if (n < 3) {
+			polygon.m_TriangMin = 0;
+			return;
+		}
+		const vector<CPoint> &points = polygon.m_Points;
+		CDiagonals diag(points);
+		CPackedTable<double> cost(diag);
+
+		for (size_t len = 2; len < n; ++len) {
+			for (size_t i = 0; i + len < n; ++i) {
+				size_t j = i + len;
+				if (!diag.isUsable(i, j))
+					continue;
+				double best = HUGE_VAL;
+				for (size_t k = i + 1; k < j; ++k) {
+					if (!diag.isUsable(i, k) || !diag.isUsable(k, j))
+						continue;
+					double split = (k == i + 1 ? 0 : cost.at(i, k)) + (k + 1 == j ? 0 : cost.at(k, j));
+					best = min(best, split);
+				}
+				cost.at(i, j) = best + (len == n - 1 ? 0 : distance(points[i], points[j]));
+			}
+		}
+		polygon.m_TriangMin = cost.at(0, n - 1) + perimeter(points);
+	}
+};
+
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 class CProblemWrap;
 
@@ -66,13 +424,13 @@ public:
 		return m_ToSolve == 0;
 	}
 
-	void markSolved() {
+	void markSolved(size_t count = 1) {
 		lock_guard guard(m_mut);
-		if (m_ToSolve == 0) {
+		if (m_ToSolve < count) {
 			throw logic_error("Can't mark solved more than there is"); // todo: if good, remove
 		}
 
-		--m_ToSolve;
+		m_ToSolve -= count;
 		if (m_ToSolve == 0) {
 			m_cond.notify_all();
 		}
@@ -94,6 +452,14 @@ public:
 		++m_mark;
 		m_parent->markSolved();
 	}
+	CPackWrap *getParent() const {
+		return m_parent;
+	}
+	// marks only this problem, the caller notifies the returned pack (in bulk)
+	CPackWrap *markSolvedQuiet() {
+		++m_mark;
+		return m_parent;
+	}
 };
 
 class CCompanyWrap {
@@ -218,9 +584,15 @@ private:
 			}
 			// solve it
 			solver->m_solver->solve();
-			// mark elements as solved
-			for (auto &pol : solver->m_solving) {
-				pol->markSolved();
+			// mark elements as solved, one lock per pack instead of one per polygon
+			for (size_t i = 0; i < solver->m_solving.size();) {
+				CPackWrap *pack = solver->m_solving[i]->markSolvedQuiet();
+				size_t count = 1;
+				while (++i < solver->m_solving.size() && solver->m_solving[i]->getParent() == pack) {
+					solver->m_solving[i]->markSolvedQuiet();
+					++count;
+				}
+				pack->markSolved(count);
 			}
 			// todo: notify output thread if pack solved?
 		}
@@ -242,10 +614,11 @@ public:
 		return true;
 	}
 	static void checkAlgorithmMin(APolygon p) {
-		// dummy implementation if usingProgtestSolver() returns true
+		CMinSolver::solveOne(*p);
 	}
 	static void checkAlgorithmCnt(APolygon p) {
-		// dummy implementation if usingProgtestSolver() returns true
+		CCntSolver solver;
+		solver.solveOne(*p);
 	}
 	void addCompany(ACompany company) {
 		m_Companies.emplace_back(make_shared<CCompanyWrap>(company));
@@ -282,6 +655,24 @@ public:
 //-------------------------------------------------------------------------------------------------------------------------------------------------------------
 #ifndef __PROGTEST__
 int main(void) {
+	{
+		APolygon square = make_shared<CPolygon>(vector<CPoint>{{0, 0}, {0, 10}, {10, 10}, {10, 0}});
+		APolygon arrow = make_shared<CPolygon>(vector<CPoint>{{0, 0}, {5, 100}, {10, 0}, {5, 98}});
+		COptimizer::checkAlgorithmCnt(square);
+		COptimizer::checkAlgorithmCnt(arrow);
+		assert(square->m_TriangCnt == CBigInt(2));
+		assert(arrow->m_TriangCnt == CBigInt(1));
+
+		CMinSolver batch(3);
+		APolygon copy = make_shared<CPolygon>(square->m_Points);
+		batch.addPolygon(square);
+		batch.addPolygon(arrow);
+		batch.addPolygon(copy);
+		assert(batch.solve() == 3);
+		assert(fabs(square->m_TriangMin - 54.1421356237) < 1e-6);
+		assert(fabs(arrow->m_TriangMin - 398.504780189) < 1e-6);
+		assert(square->m_TriangMin == copy->m_TriangMin);
+	}
 	for (int j = 0; j < 100; ++j) {
 		COptimizer optimizer;
 		vector<ACompanyTest> companies;
@@ -6,6 +6,8 @@
 #include <cstdlib>	 // unused
 #include <cstring>	 // used in testing only, wanted to use memcpy
 #include <stdexcept> // used only outside progtest, cross includes cstdio
+#include <pthread.h> // used only by RAID_PARALLEL_IO and RAID_THREAD_SAFE
+#include <ctime>	 // used only by the I/O statistics, for clock_gettime
 using namespace std;
 
 constexpr int SECTOR_SIZE = 512;
@@ -28,198 +30,2531 @@ struct TBlkDev {
 };
 #endif /* __PROGTEST__ */
 
+// size of the buffer for multi-sector transfers, 256 KiB
+constexpr int STAGE_SECTORS = 512;
+#ifdef RAID_THREAD_SAFE
+// callers with a staging buffer at the same time, the rest waits
+constexpr int STAGE_BUFFERS = 4;
+#else
+constexpr int STAGE_BUFFERS = 1;
+#endif
+// reads and writes the range lock can hold at the same time
+constexpr int RANGE_LOCKS = 64;
+// parity rotation, see getParityDevByRow
+constexpr int LAYOUT_RIGHT_ASYMMETRIC = 0;
+constexpr int LAYOUT_LEFT_SYMMETRIC = 1;
+// sectors a device holds before the stripe moves on to the next device, 4 KiB
+constexpr int DEFAULT_CHUNK_SECTORS = 8;
+constexpr int MAX_CHUNK_SECTORS = 256;
+// default budget of the stripe cache, 128 KiB
+constexpr int CACHE_BYTES = 128 * 1024;
+// default size of the read-ahead buffer, 128 KiB
+constexpr int READAHEAD_BYTES = 128 * 1024;
+// resync persists its progress every this many rows
+constexpr int CHECKPOINT_ROWS = 4 * 1024;
+// sectors at the end of every disk not used for data: allocation bitmap, write-intent bitmap, SOverhead
+constexpr int OVERHEAD_SECTORS = 3;
+// where the bitmaps are, counted back from the end of a disk
+constexpr int INTENT_SECTOR_BACK = 2;
+constexpr int WRITTEN_SECTOR_BACK = 3;
+
+// latency histogram of the device calls, bucket b counts calls under 2^b microseconds, the last one the rest
+constexpr int LATENCY_BUCKETS = 16;
+// a bitmap takes one sector, so the data rows are split into this many regions
+constexpr int INTENT_REGIONS = SECTOR_SIZE * 8;
+
+// the bits are accessed atomically, a reader does not have to hold the lock of the writer
 class CStatus {
 private:
 	uint16_t m_status;
 
+	uint16_t load() const {
+		return __atomic_load_n(&m_status, __ATOMIC_ACQUIRE);
+	}
+
 public:
 	CStatus(uint16_t status = 0) : m_status(status) {}
 	bool getStatus(int dev) const {
-		return ((m_status >> dev) & 0b1);
+		return ((load() >> dev) & 0b1);
 	}
 	void setStatus(int dev, bool bit) {
 		if (bit)
-			m_status |= (0b1 << dev);
+			__atomic_fetch_or(&m_status, (uint16_t)(0b1 << dev), __ATOMIC_RELEASE);
 		else
-			m_status &= (0b1 << dev) ^ 0xffff;
+			__atomic_fetch_and(&m_status, (uint16_t)((0b1 << dev) ^ 0xffff), __ATOMIC_RELEASE);
 	}
 	bool operator==(const CStatus &other) const {
-		return m_status == other.m_status;
+		return load() == other.load();
 	}
 	bool operator!=(const CStatus &other) const {
-		return m_status != other.m_status;
+		return load() != other.load();
+	}
+};
+
+/**
+ * @brief: An int with atomic loads and stores, the status of the RAID is checked without a lock
+ */
+class CAtomicInt {
+private:
+	int m_value;
+
+public:
+	CAtomicInt(int value = 0) : m_value(value) {}
+	operator int() const {
+		return __atomic_load_n(&m_value, __ATOMIC_ACQUIRE);
+	}
+	CAtomicInt &operator=(int value) {
+		__atomic_store_n(&m_value, value, __ATOMIC_RELEASE);
+		return *this;
 	}
 };
 
 struct SOverhead {
 	size_t m_version;
 	CStatus m_status;
-	SOverhead(size_t version = 0, int diskCount = 0) : m_version(version), m_status(0xffff >> (16 - diskCount)) {}
-	SOverhead(size_t version, const CStatus &status) : m_version(version), m_status(status) {}
+	// rebuild checkpoint: rows below m_rebuildRow of m_rebuildDisk are already rebuilt, -1 when there is none
+	int m_rebuildDisk;
+	int m_rebuildRow;
+	// identifies the rebuild, the disk being rebuilt carries the same id in its own overhead sector
+	size_t m_rebuildId;
+	// disk the write-intent bitmap is kept for, -1 when there is none
+	int m_intentDisk;
+	// version of the overhead the disk had when it dropped out, a returning disk still has it
+	size_t m_intentBase;
+	// layout chosen at create
+	int m_chunkSectors;
+	int m_layout;
+	// rows below it were checked by the current scrub pass
+	int m_scrubRow;
+	SOverhead(size_t version = 0, int diskCount = 0, int chunkSectors = 1, int layout = LAYOUT_RIGHT_ASYMMETRIC) : m_version(version), m_status(0xffff >> (16 - diskCount)), m_rebuildDisk(-1), m_rebuildRow(0), m_rebuildId(0), m_intentDisk(-1), m_intentBase(0), m_chunkSectors(chunkSectors), m_layout(layout), m_scrubRow(0) {}
+	SOverhead(size_t version, const CStatus &status) : m_version(version), m_status(status), m_rebuildDisk(-1), m_rebuildRow(0), m_rebuildId(0), m_intentDisk(-1), m_intentBase(0), m_chunkSectors(1), m_layout(LAYOUT_RIGHT_ASYMMETRIC), m_scrubRow(0) {}
 
 	bool operator==(const SOverhead &other) const {
-		return m_version == other.m_version && m_status == other.m_status;
+		return m_version == other.m_version && m_status == other.m_status && m_rebuildDisk == other.m_rebuildDisk && m_rebuildRow == other.m_rebuildRow && m_rebuildId == other.m_rebuildId && m_intentDisk == other.m_intentDisk && m_intentBase == other.m_intentBase && m_chunkSectors == other.m_chunkSectors && m_layout == other.m_layout && m_scrubRow == other.m_scrubRow;
 	}
 	bool operator!=(const SOverhead &other) const {
-		return m_version != other.m_version || m_status != other.m_status;
+		return !(*this == other);
+	}
+};
+
+/**
+ * @brief: dst = src[0] ^ src[1] ^ ... ^ src[srcCnt - 1], in a single pass over the sources
+ * @note: bytes has to be a multiple of SECTOR_SIZE, dst may be one of the sources.
+ * W_ is the width of the vector in bytes, the caller's target attribute decides which instructions are used
+ */
+template <int W_>
+__attribute__((always_inline)) inline void XORKernel(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	typedef uint64_t TVec __attribute__((vector_size(W_)));
+	constexpr int UNROLL = 4;
+	for (int off = 0; off < bytes; off += UNROLL * W_) {
+		TVec acc[UNROLL];
+		// memcpy of a vector is an unaligned load/store, the buffers come from the tester
+		__builtin_memcpy(acc, src[0] + off, sizeof(acc));
+		for (int s = 1; s < srcCnt; ++s) {
+			TVec tmp[UNROLL];
+			__builtin_memcpy(tmp, src[s] + off, sizeof(tmp));
+			for (int u = 0; u < UNROLL; ++u)
+				acc[u] ^= tmp[u];
+		}
+		__builtin_memcpy(dst + off, acc, sizeof(acc));
+	}
+}
+
+typedef void (*TXORFunc)(uint8_t *, const uint8_t *const *, int, int);
+
+void XORScalar(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	XORKernel<8>(dst, src, srcCnt, bytes);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void XORSSE2(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	XORKernel<16>(dst, src, srcCnt, bytes);
+}
+__attribute__((target("avx2"))) void XORAVX2(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	XORKernel<32>(dst, src, srcCnt, bytes);
+}
+__attribute__((target("avx512f"))) void XORAVX512(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	XORKernel<64>(dst, src, srcCnt, bytes);
+}
+#endif
+
+/**
+ * @returns: The widest XOR kernel the CPU we run on supports
+ */
+TXORFunc pickXOR() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return XORAVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return XORAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return XORSSE2;
+#endif
+	return XORScalar;
+}
+
+void XORBlocks(uint8_t *dst, const uint8_t *const *src, int srcCnt, int bytes) {
+	static const TXORFunc xorFunc = pickXOR();
+	xorFunc(dst, src, srcCnt, bytes);
+}
+
+// maybe cstring is not included? the builtin does not need it
+void mymemcpy(void *dst, const void *src, int n) {
+	__builtin_memcpy(dst, src, n);
+}
+
+/**
+ * @brief: LRU set of cached rows (stripes), a stripe holds the sector of every device in its row
+ * @note: Only bookkeeping, reading and writing the sectors is up to the volume
+ */
+class CStripeCache {
+private:
+	struct SStripe {
+		// -1 for a free slot
+		int m_row;
+		// per device: the sector is loaded, the sector is newer than the one on the device
+		CStatus m_valid;
+		CStatus m_dirty;
+		// LRU list, m_head is the most recently used, free slots are chained by m_next
+		int m_prev;
+		int m_next;
+		int m_hashNext;
+	};
+
+	SStripe *m_stripes;
+	uint8_t *m_data;
+	int *m_buckets;
+	// dirty slots sorted by row, filled by sortedDirty
+	int *m_order;
+	int m_capacity;
+	int m_width;
+	int m_bucketCnt;
+	int m_head;
+	int m_tail;
+	int m_free;
+
+	int &bucket(int row) {
+		return m_buckets[row % m_bucketCnt];
+	}
+
+	void unlink(int slot) {
+		SStripe &stripe = m_stripes[slot];
+		if (stripe.m_prev != -1)
+			m_stripes[stripe.m_prev].m_next = stripe.m_next;
+		else
+			m_head = stripe.m_next;
+		if (stripe.m_next != -1)
+			m_stripes[stripe.m_next].m_prev = stripe.m_prev;
+		else
+			m_tail = stripe.m_prev;
+	}
+
+	void linkHead(int slot) {
+		m_stripes[slot].m_prev = -1;
+		m_stripes[slot].m_next = m_head;
+		if (m_head != -1)
+			m_stripes[m_head].m_prev = slot;
+		else
+			m_tail = slot;
+		m_head = slot;
+	}
+
+	void unhash(int slot) {
+		int *link = &bucket(m_stripes[slot].m_row);
+		while (*link != slot)
+			link = &m_stripes[*link].m_hashNext;
+		*link = m_stripes[slot].m_hashNext;
+	}
+
+public:
+	CStripeCache() : m_stripes(nullptr), m_data(nullptr), m_buckets(nullptr), m_order(nullptr), m_capacity(0), m_width(0), m_bucketCnt(0), m_head(-1), m_tail(-1), m_free(-1) {}
+	~CStripeCache() {
+		release();
+	}
+	CStripeCache(const CStripeCache &) = delete;
+	CStripeCache &operator=(const CStripeCache &) = delete;
+
+	void release() {
+		delete[] m_stripes;
+		delete[] m_data;
+		delete[] m_buckets;
+		delete[] m_order;
+		m_stripes = nullptr;
+		m_data = nullptr;
+		m_buckets = nullptr;
+		m_order = nullptr;
+		m_capacity = m_width = m_bucketCnt = 0;
+	}
+
+	/**
+	 * @brief: Makes room for capacity stripes of width sectors, drops everything cached
+	 */
+	void init(int capacity, int width) {
+		if (capacity != m_capacity || width != m_width) {
+			release();
+			if (capacity <= 0)
+				return;
+			m_capacity = capacity;
+			m_width = width;
+			m_bucketCnt = 2 * capacity;
+			m_stripes = new SStripe[m_capacity];
+			m_data = new uint8_t[m_capacity * m_width * SECTOR_SIZE];
+			m_buckets = new int[m_bucketCnt];
+			m_order = new int[m_capacity];
+		}
+		clear();
+	}
+
+	void clear() {
+		for (int i = 0; i < m_bucketCnt; ++i)
+			m_buckets[i] = -1;
+		m_head = m_tail = -1;
+		m_free = m_capacity > 0 ? 0 : -1;
+		for (int slot = 0; slot < m_capacity; ++slot) {
+			m_stripes[slot].m_row = -1;
+			m_stripes[slot].m_next = slot + 1 < m_capacity ? slot + 1 : -1;
+		}
+	}
+
+	int capacity() const {
+		return m_capacity;
+	}
+
+	/**
+	 * @returns: The slot of a row, -1 when it is not cached
+	 */
+	int find(int row) const {
+		if (m_capacity == 0)
+			return -1;
+		int slot = m_buckets[row % m_bucketCnt];
+		while (slot != -1 && m_stripes[slot].m_row != row)
+			slot = m_stripes[slot].m_hashNext;
+		return slot;
+	}
+
+	void touch(int slot) {
+		if (m_head == slot)
+			return;
+		unlink(slot);
+		linkHead(slot);
+	}
+
+	/**
+	 * @returns: The slot the next insert takes over, -1 while there are free slots
+	 */
+	int victim() const {
+		return m_free == -1 ? m_tail : -1;
+	}
+
+	/**
+	 * @brief: Caches a row with nothing loaded yet, the least recently used stripe makes room for it
+	 * @note: The victim is dropped as is, so it should not be dirty
+	 */
+	int insert(int row) {
+		int slot = m_free;
+		if (slot != -1)
+			m_free = m_stripes[slot].m_next;
+		else {
+			slot = m_tail;
+			unhash(slot);
+			unlink(slot);
+		}
+		SStripe &stripe = m_stripes[slot];
+		stripe.m_row = row;
+		stripe.m_valid = stripe.m_dirty = CStatus();
+		stripe.m_hashNext = bucket(row);
+		bucket(row) = slot;
+		linkHead(slot);
+		return slot;
+	}
+
+	/**
+	 * @brief: Forgets the cached rows [rowFrom, rowTo), dirty or not
+	 */
+	void drop(int rowFrom, int rowTo) {
+		for (int slot = 0; slot < m_capacity; ++slot) {
+			int row = m_stripes[slot].m_row;
+			if (row < rowFrom || row >= rowTo)
+				continue;
+			unhash(slot);
+			unlink(slot);
+			m_stripes[slot].m_row = -1;
+			m_stripes[slot].m_next = m_free;
+			m_free = slot;
+		}
+	}
+
+	int row(int slot) const {
+		return m_stripes[slot].m_row;
+	}
+	CStatus &valid(int slot) {
+		return m_stripes[slot].m_valid;
+	}
+	CStatus &dirty(int slot) {
+		return m_stripes[slot].m_dirty;
+	}
+	uint8_t *sector(int slot, int disk) const {
+		return m_data + (slot * m_width + disk) * SECTOR_SIZE;
+	}
+
+	/**
+	 * @returns: The dirty slots of rows [rowFrom, rowTo) sorted by row, valid until the next call
+	 */
+	const int *sortedDirty(int &count, int rowFrom, int rowTo) {
+		count = 0;
+		for (int slot = 0; slot < m_capacity; ++slot) {
+			int row = m_stripes[slot].m_row;
+			if (row < rowFrom || row >= rowTo || m_stripes[slot].m_dirty == CStatus())
+				continue;
+			// insertion sort, there are only a few dozen stripes
+			int pos = count++;
+			while (pos > 0 && m_stripes[m_order[pos - 1]].m_row > m_stripes[slot].m_row) {
+				m_order[pos] = m_order[pos - 1];
+				--pos;
+			}
+			m_order[pos] = slot;
+		}
+		return m_order;
+	}
+};
+
+/**
+ * @brief: Read-ahead buffer of a single sequential reader, holds the volume sectors [m_from, m_to)
+ * @note: The window grows twice with every refill up to the capacity, a read anywhere else shrinks it back
+ */
+class CReadAhead {
+private:
+	uint8_t *m_buf;
+	int m_capacity;
+	int m_from;
+	int m_to;
+	// where the next read of the stream starts
+	int m_next;
+	int m_window;
+
+public:
+	CReadAhead() : m_buf(nullptr), m_capacity(0), m_from(0), m_to(0), m_next(-1), m_window(0) {}
+	~CReadAhead() {
+		delete[] m_buf;
+	}
+	CReadAhead(const CReadAhead &) = delete;
+	CReadAhead &operator=(const CReadAhead &) = delete;
+
+	/**
+	 * @param capacity: sectors of the buffer, 0 turns read-ahead off
+	 */
+	void init(int capacity) {
+		if (capacity != m_capacity) {
+			delete[] m_buf;
+			m_buf = capacity > 0 ? new uint8_t[capacity * SECTOR_SIZE] : nullptr;
+			m_capacity = capacity;
+		}
+		reset();
+	}
+
+	void reset() {
+		m_from = m_to = 0;
+		m_next = -1;
+		m_window = 0;
+	}
+
+	int capacity() const {
+		return m_capacity;
+	}
+
+	/**
+	 * @returns: True when the read continues the previous one
+	 */
+	bool sequential(int secNr, int secCnt) {
+		bool toRet = secNr == m_next;
+		m_next = secNr + secCnt;
+		if (!toRet)
+			m_window = 0;
+		return toRet;
+	}
+
+	/**
+	 * @returns: Sectors to read ahead from the start of a request of secCnt sectors, grows the window for the next time
+	 */
+	int window(int secCnt) {
+		m_window = m_window < 4 * secCnt ? 4 * secCnt : m_window;
+		m_window = m_window < m_capacity ? m_window : m_capacity;
+		int toRet = m_window;
+		m_window = 2 * m_window < m_capacity ? 2 * m_window : m_capacity;
+		return toRet;
+	}
+
+	/**
+	 * @brief: Copies the sectors out when the buffer holds all of them
+	 */
+	bool find(int secNr, int secCnt, uint8_t *data) const {
+		if (secNr < m_from || secNr + secCnt > m_to)
+			return false;
+		mymemcpy(data, m_buf + (secNr - m_from) * SECTOR_SIZE, secCnt * SECTOR_SIZE);
+		return true;
+	}
+
+	uint8_t *buffer() {
+		return m_buf;
+	}
+	void filled(int from, int to) {
+		m_from = from;
+		m_to = to;
+	}
+
+	/**
+	 * @brief: Forgets the buffer when a write changed any of its sectors
+	 */
+	void drop(int from, int to) {
+		if (from < m_to && m_from < to)
+			m_from = m_to = 0;
+	}
+};
+
+/**
+ * @brief: A segment of a vectored request, m_secCnt volume sectors from m_secNr kept in m_data
+ */
+struct SIOVec {
+	int m_secNr;
+	void *m_data;
+	int m_secCnt;
+};
+
+/**
+ * @brief: Buffers of the volume sectors of a run of segments, every segment starts at or after the end of the previous one
+ * @note: Sectors in the gaps between the segments have no buffer
+ */
+class CSegments {
+private:
+	const SIOVec *m_segs;
+	int m_cnt;
+	// segment of the last lookup, requests mostly walk the sectors in order
+	mutable int m_cur;
+
+public:
+	CSegments(const SIOVec *segs, int cnt) : m_segs(segs), m_cnt(cnt), m_cur(0) {}
+
+	/**
+	 * @returns: The buffer of a volume sector, nullptr when no segment holds it
+	 */
+	uint8_t *sector(int secNr) const {
+		if (secNr < m_segs[m_cur].m_secNr || (m_cur + 1 < m_cnt && secNr >= m_segs[m_cur + 1].m_secNr)) {
+			if (m_cur + 2 < m_cnt && secNr >= m_segs[m_cur + 1].m_secNr && secNr < m_segs[m_cur + 2].m_secNr)
+				++m_cur;
+			else {
+				// the last segment starting at or before the sector
+				int lo = 0, hi = m_cnt;
+				while (hi - lo > 1) {
+					int mid = (lo + hi) / 2;
+					(secNr < m_segs[mid].m_secNr ? hi : lo) = mid;
+				}
+				m_cur = lo;
+			}
+		}
+		const SIOVec &seg = m_segs[m_cur];
+		if (secNr < seg.m_secNr || secNr >= seg.m_secNr + seg.m_secCnt)
+			return nullptr;
+		return (uint8_t *)seg.m_data + (size_t)(secNr - seg.m_secNr) * SECTOR_SIZE;
+	}
+};
+
+/**
+ * @brief: Recursive mutex, does nothing unless built with RAID_THREAD_SAFE
+ */
+class CMutex {
+#ifdef RAID_THREAD_SAFE
+private:
+	pthread_mutex_t m_mutex;
+
+public:
+	CMutex() {
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&m_mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	~CMutex() {
+		pthread_mutex_destroy(&m_mutex);
+	}
+	void lock() {
+		pthread_mutex_lock(&m_mutex);
+	}
+	void unlock() {
+		pthread_mutex_unlock(&m_mutex);
+	}
+#else
+public:
+	CMutex() = default;
+	void lock() {}
+	void unlock() {}
+#endif
+	CMutex(const CMutex &) = delete;
+	CMutex &operator=(const CMutex &) = delete;
+};
+
+class CGuard {
+private:
+	CMutex &m_mutex;
+
+public:
+	CGuard(CMutex &mutex) : m_mutex(mutex) {
+		m_mutex.lock();
+	}
+	~CGuard() {
+		m_mutex.unlock();
+	}
+	CGuard(const CGuard &) = delete;
+	CGuard &operator=(const CGuard &) = delete;
+};
+
+/**
+ * @brief: Reads and writes share the volume, start, stop, resync and flush have it to themselves
+ */
+class CVolumeLock {
+#ifdef RAID_THREAD_SAFE
+private:
+	pthread_rwlock_t m_lock;
+
+public:
+	CVolumeLock() {
+		pthread_rwlock_init(&m_lock, nullptr);
+	}
+	~CVolumeLock() {
+		pthread_rwlock_destroy(&m_lock);
+	}
+	void lock(bool exclusive) {
+		if (exclusive)
+			pthread_rwlock_wrlock(&m_lock);
+		else
+			pthread_rwlock_rdlock(&m_lock);
+	}
+	void unlock() {
+		pthread_rwlock_unlock(&m_lock);
+	}
+#else
+public:
+	CVolumeLock() = default;
+	void lock(bool) {}
+	void unlock() {}
+#endif
+	CVolumeLock(const CVolumeLock &) = delete;
+	CVolumeLock &operator=(const CVolumeLock &) = delete;
+};
+
+class CVolumeGuard {
+private:
+	CVolumeLock &m_lock;
+
+public:
+	CVolumeGuard(CVolumeLock &lock, bool exclusive) : m_lock(lock) {
+		m_lock.lock(exclusive);
+	}
+	~CVolumeGuard() {
+		m_lock.unlock();
+	}
+	CVolumeGuard(const CVolumeGuard &) = delete;
+	CVolumeGuard &operator=(const CVolumeGuard &) = delete;
+};
+
+/**
+ * @brief: Locks ranges of rows, a write waits for everything overlapping it, reads only wait for writes
+ * @note: Parity is shared by the whole row, so writes to different sectors of a row are serialized too
+ */
+class CRangeLock {
+#ifdef RAID_THREAD_SAFE
+private:
+	struct SRange {
+		int m_from;
+		int m_to;
+		bool m_exclusive;
+		bool m_used;
+	};
+	SRange m_ranges[RANGE_LOCKS];
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_released;
+
+	bool conflicts(int from, int to, bool exclusive) const {
+		for (int i = 0; i < RANGE_LOCKS; ++i) {
+			const SRange &range = m_ranges[i];
+			if (range.m_used && (exclusive || range.m_exclusive) && range.m_from < to && from < range.m_to)
+				return true;
+		}
+		return false;
+	}
+
+public:
+	CRangeLock() {
+		for (int i = 0; i < RANGE_LOCKS; ++i)
+			m_ranges[i].m_used = false;
+		pthread_mutex_init(&m_mutex, nullptr);
+		pthread_cond_init(&m_released, nullptr);
+	}
+	~CRangeLock() {
+		pthread_mutex_destroy(&m_mutex);
+		pthread_cond_destroy(&m_released);
+	}
+
+	/**
+	 * @returns: Id of the lock for unlock
+	 */
+	int lock(int from, int to, bool exclusive) {
+		pthread_mutex_lock(&m_mutex);
+		while (true) {
+			int freeId = -1;
+			for (int i = 0; i < RANGE_LOCKS && freeId == -1; ++i)
+				if (!m_ranges[i].m_used)
+					freeId = i;
+			if (freeId != -1 && !conflicts(from, to, exclusive)) {
+				m_ranges[freeId].m_from = from;
+				m_ranges[freeId].m_to = to;
+				m_ranges[freeId].m_exclusive = exclusive;
+				m_ranges[freeId].m_used = true;
+				pthread_mutex_unlock(&m_mutex);
+				return freeId;
+			}
+			pthread_cond_wait(&m_released, &m_mutex);
+		}
+	}
+
+	void unlock(int id) {
+		pthread_mutex_lock(&m_mutex);
+		m_ranges[id].m_used = false;
+		pthread_cond_broadcast(&m_released);
+		pthread_mutex_unlock(&m_mutex);
+	}
+#else
+public:
+	CRangeLock() = default;
+	int lock(int, int, bool) {
+		return 0;
+	}
+	void unlock(int) {}
+#endif
+	CRangeLock(const CRangeLock &) = delete;
+	CRangeLock &operator=(const CRangeLock &) = delete;
+};
+
+class CRangeGuard {
+private:
+	CRangeLock &m_lock;
+	int m_id;
+
+public:
+	CRangeGuard(CRangeLock &lock, int from, int to, bool exclusive) : m_lock(lock), m_id(lock.lock(from, to, exclusive)) {}
+	~CRangeGuard() {
+		m_lock.unlock(m_id);
+	}
+	CRangeGuard(const CRangeGuard &) = delete;
+	CRangeGuard &operator=(const CRangeGuard &) = delete;
+};
+
+/**
+ * @brief: Staging buffers for multi-sector transfers, a caller holds one for the whole request
+ * @note: Allocated on first use, so a single caller only ever takes the memory of one
+ */
+class CStagePool {
+private:
+	uint8_t *m_stages[STAGE_BUFFERS];
+	bool m_busy[STAGE_BUFFERS];
+#ifdef RAID_THREAD_SAFE
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_released;
+#endif
+
+public:
+	CStagePool() {
+		for (int i = 0; i < STAGE_BUFFERS; ++i) {
+			m_stages[i] = nullptr;
+			m_busy[i] = false;
+		}
+#ifdef RAID_THREAD_SAFE
+		pthread_mutex_init(&m_mutex, nullptr);
+		pthread_cond_init(&m_released, nullptr);
+#endif
+	}
+	~CStagePool() {
+		for (int i = 0; i < STAGE_BUFFERS; ++i)
+			delete[] m_stages[i];
+#ifdef RAID_THREAD_SAFE
+		pthread_mutex_destroy(&m_mutex);
+		pthread_cond_destroy(&m_released);
+#endif
+	}
+	CStagePool(const CStagePool &) = delete;
+	CStagePool &operator=(const CStagePool &) = delete;
+
+	uint8_t *acquire() {
+#ifdef RAID_THREAD_SAFE
+		pthread_mutex_lock(&m_mutex);
+#endif
+		int id = -1;
+		while (id == -1) {
+			for (int i = 0; i < STAGE_BUFFERS && id == -1; ++i)
+				if (!m_busy[i])
+					id = i;
+#ifdef RAID_THREAD_SAFE
+			if (id == -1)
+				pthread_cond_wait(&m_released, &m_mutex);
+#endif
+		}
+		m_busy[id] = true;
+		if (!m_stages[id])
+			m_stages[id] = new uint8_t[STAGE_SECTORS * SECTOR_SIZE];
+#ifdef RAID_THREAD_SAFE
+		pthread_mutex_unlock(&m_mutex);
+#endif
+		return m_stages[id];
+	}
+
+	void release(uint8_t *stage) {
+#ifdef RAID_THREAD_SAFE
+		pthread_mutex_lock(&m_mutex);
+#endif
+		for (int i = 0; i < STAGE_BUFFERS; ++i)
+			if (m_stages[i] == stage)
+				m_busy[i] = false;
+#ifdef RAID_THREAD_SAFE
+		pthread_cond_signal(&m_released);
+		pthread_mutex_unlock(&m_mutex);
+#endif
+	}
+};
+
+/**
+ * @brief: Holds a staging buffer of the pool until the end of the scope
+ */
+class CStage {
+private:
+	CStagePool &m_pool;
+	uint8_t *m_stage;
+
+public:
+	CStage(CStagePool &pool) : m_pool(pool), m_stage(pool.acquire()) {}
+	~CStage() {
+		m_pool.release(m_stage);
+	}
+	CStage(const CStage &) = delete;
+	CStage &operator=(const CStage &) = delete;
+	operator uint8_t *() const {
+		return m_stage;
+	}
+};
+
+/**
+ * @brief: I/O of a single device since the volume was created or the statistics were reset
+ */
+struct SDiskStats {
+	uint64_t m_reads;
+	uint64_t m_readSectors;
+	uint64_t m_writes;
+	uint64_t m_writtenSectors;
+	// sectors of the device recovered from the rest of their rows while it was missing
+	uint64_t m_reconstructed;
+	// empty when the platform has no monotonic clock
+	uint64_t m_readLatency[LATENCY_BUCKETS];
+	uint64_t m_writeLatency[LATENCY_BUCKETS];
+
+	uint64_t sectors() const {
+		return m_readSectors + m_writtenSectors;
+	}
+};
+
+/**
+ * @brief: Snapshot of the statistics of a volume
+ */
+struct SRaidStats {
+	int m_devices;
+	SDiskStats m_disks[MAX_RAID_DEVICES];
+	// sectors written into a part of a stripe, the old data and parity of the row are read to update the parity
+	// (once per row while it stays in the stripe cache)
+	uint64_t m_rmwWrites;
+	// sectors written into a part of a stripe, the rest of the row is read and the parity computed from all of it
+	uint64_t m_rcwWrites;
+	// stripes written whole, the parity computed from the new data alone
+	uint64_t m_fullStripeWrites;
+
+	/**
+	 * @returns: Sectors transferred by the busiest device over the average of all of them, 1 is an even load
+	 */
+	double imbalance() const {
+		uint64_t total = 0, busiest = 0;
+		for (int disk = 0; disk < m_devices; ++disk) {
+			total += m_disks[disk].sectors();
+			busiest = m_disks[disk].sectors() > busiest ? m_disks[disk].sectors() : busiest;
+		}
+		return total == 0 ? 1 : (double)busiest * m_devices / total;
+	}
+};
+
+/**
+ * @brief: Counters behind SRaidStats, updated atomically from any thread
+ */
+class CIOStats {
+private:
+	// SDiskStats has nothing but counters, all the devices are walked as one array
+	static constexpr int DISK_COUNTERS = MAX_RAID_DEVICES * sizeof(SDiskStats) / sizeof(uint64_t);
+
+	SRaidStats m_stats;
+
+	static void add(uint64_t &counter, uint64_t value) {
+		__atomic_fetch_add(&counter, value, __ATOMIC_RELAXED);
+	}
+	static uint64_t load(const uint64_t &counter) {
+		return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+	}
+
+public:
+	CIOStats() {
+		reset();
+	}
+
+	/**
+	 * @returns: A monotonic time in nanoseconds, 0 when the platform has no monotonic clock
+	 */
+	static uint64_t now() {
+#ifdef CLOCK_MONOTONIC
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+		return 0;
+#endif
+	}
+
+	void reset() {
+		uint64_t *counters = (uint64_t *)&m_stats.m_disks;
+		for (int i = 0; i < DISK_COUNTERS; ++i)
+			__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_stats.m_rmwWrites, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_stats.m_rcwWrites, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&m_stats.m_fullStripeWrites, 0, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * @param nanos: how long the call took, started at now()
+	 */
+	void transfer(int disk, bool write, int count, uint64_t nanos) {
+		SDiskStats &stats = m_stats.m_disks[disk];
+		add(write ? stats.m_writes : stats.m_reads, 1);
+		add(write ? stats.m_writtenSectors : stats.m_readSectors, count);
+#ifdef CLOCK_MONOTONIC
+		int bucket = 0;
+		for (uint64_t micros = nanos / 1000; micros > 0 && bucket < LATENCY_BUCKETS - 1; micros >>= 1)
+			++bucket;
+		add(write ? stats.m_writeLatency[bucket] : stats.m_readLatency[bucket], 1);
+#endif
+	}
+	void reconstructed(int disk, int count) {
+		add(m_stats.m_disks[disk].m_reconstructed, count);
+	}
+	void rmwWrites(int count) {
+		add(m_stats.m_rmwWrites, count);
+	}
+	void rcwWrites(int count) {
+		add(m_stats.m_rcwWrites, count);
+	}
+	void fullStripeWrites(int count) {
+		add(m_stats.m_fullStripeWrites, count);
+	}
+
+	void snapshot(SRaidStats &out, int devices) const {
+		out.m_devices = devices;
+		const uint64_t *from = (const uint64_t *)&m_stats.m_disks;
+		uint64_t *to = (uint64_t *)&out.m_disks;
+		for (int i = 0; i < DISK_COUNTERS; ++i)
+			to[i] = load(from[i]);
+		out.m_rmwWrites = load(m_stats.m_rmwWrites);
+		out.m_rcwWrites = load(m_stats.m_rcwWrites);
+		out.m_fullStripeWrites = load(m_stats.m_fullStripeWrites);
+	}
+};
+
+/**
+ * @brief: One transfer of consecutive sectors of a device
+ */
+struct STransfer {
+	int m_disk;
+	int m_sector;
+	uint8_t *m_buf;
+	int m_count;
+	bool m_write;
+	// the device was alive, so the transfer was tried
+	bool m_issued;
+	bool m_ok;
+	// duration of the call, for the statistics
+	uint64_t m_nanos;
+	// queue of the I/O engine
+	STransfer *m_next;
+	struct SBatch *m_batch;
+	STransfer(int disk = 0, int sector = 0, uint8_t *buf = nullptr, int count = 1, bool write = false) : m_disk(disk), m_sector(sector), m_buf(buf), m_count(count), m_write(write), m_issued(false), m_ok(false), m_nanos(0), m_next(nullptr), m_batch(nullptr) {}
+
+	void run(const TBlkDev &dev) {
+		uint64_t start = CIOStats::now();
+		m_ok = (m_write ? dev.m_Write(m_disk, m_sector, m_buf, m_count) : dev.m_Read(m_disk, m_sector, m_buf, m_count)) == m_count;
+		m_nanos = CIOStats::now() - start;
+	}
+};
+
+#ifdef RAID_PARALLEL_IO
+/**
+ * @brief: Transfers of a batch that are still running
+ */
+struct SBatch {
+	pthread_mutex_t m_mutex;
+	pthread_cond_t m_done;
+	int m_left;
+};
+
+/**
+ * @brief: A worker thread per device, the transfers of a batch run on all the devices at the same time
+ * @note: The transfers of one device run in the order they were submitted
+ */
+class CIOEngine {
+private:
+	struct SQueue {
+		CIOEngine *m_engine;
+		pthread_t m_thread;
+		pthread_mutex_t m_mutex;
+		pthread_cond_t m_ready;
+		STransfer *m_head;
+		STransfer *m_tail;
+		bool m_stop;
+	};
+
+	TBlkDev m_dev;
+	SQueue m_queues[MAX_RAID_DEVICES];
+	bool m_running;
+
+	static void *worker(void *arg) {
+		SQueue &queue = *(SQueue *)arg;
+		pthread_mutex_lock(&queue.m_mutex);
+		while (true) {
+			while (!queue.m_head && !queue.m_stop)
+				pthread_cond_wait(&queue.m_ready, &queue.m_mutex);
+			if (!queue.m_head)
+				break;
+			STransfer *transfer = queue.m_head;
+			queue.m_head = transfer->m_next;
+			if (!queue.m_head)
+				queue.m_tail = nullptr;
+			pthread_mutex_unlock(&queue.m_mutex);
+
+			transfer->run(queue.m_engine->m_dev);
+			SBatch *batch = transfer->m_batch;
+			pthread_mutex_lock(&batch->m_mutex);
+			if (--batch->m_left == 0)
+				pthread_cond_signal(&batch->m_done);
+			pthread_mutex_unlock(&batch->m_mutex);
+
+			pthread_mutex_lock(&queue.m_mutex);
+		}
+		pthread_mutex_unlock(&queue.m_mutex);
+		return nullptr;
+	}
+
+public:
+	CIOEngine() : m_running(false) {}
+	~CIOEngine() {
+		stop();
+	}
+	CIOEngine(const CIOEngine &) = delete;
+	CIOEngine &operator=(const CIOEngine &) = delete;
+
+	void start(const TBlkDev &dev) {
+		stop();
+		m_dev = dev;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			SQueue &queue = m_queues[disk];
+			queue.m_engine = this;
+			queue.m_head = queue.m_tail = nullptr;
+			queue.m_stop = false;
+			pthread_mutex_init(&queue.m_mutex, nullptr);
+			pthread_cond_init(&queue.m_ready, nullptr);
+			pthread_create(&queue.m_thread, nullptr, worker, &queue);
+		}
+		m_running = true;
+	}
+
+	void stop() {
+		if (!m_running)
+			return;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			SQueue &queue = m_queues[disk];
+			pthread_mutex_lock(&queue.m_mutex);
+			queue.m_stop = true;
+			pthread_cond_signal(&queue.m_ready);
+			pthread_mutex_unlock(&queue.m_mutex);
+			pthread_join(queue.m_thread, nullptr);
+			pthread_mutex_destroy(&queue.m_mutex);
+			pthread_cond_destroy(&queue.m_ready);
+		}
+		m_running = false;
+	}
+
+	/**
+	 * @brief: Runs the issued transfers, returns once all of them finished
+	 * @note: A single transfer runs in the calling thread, there is nothing to wait for in parallel
+	 */
+	void run(STransfer *transfers, int cnt) {
+		SBatch batch;
+		batch.m_left = 0;
+		for (int i = 0; i < cnt; ++i)
+			batch.m_left += transfers[i].m_issued;
+		if (batch.m_left <= 1 || !m_running) {
+			for (int i = 0; i < cnt; ++i)
+				if (transfers[i].m_issued)
+					transfers[i].run(m_dev);
+			return;
+		}
+
+		pthread_mutex_init(&batch.m_mutex, nullptr);
+		pthread_cond_init(&batch.m_done, nullptr);
+		for (int i = 0; i < cnt; ++i) {
+			STransfer *transfer = &transfers[i];
+			if (!transfer->m_issued)
+				continue;
+			transfer->m_batch = &batch;
+			transfer->m_next = nullptr;
+			SQueue &queue = m_queues[transfer->m_disk];
+			pthread_mutex_lock(&queue.m_mutex);
+			if (queue.m_tail)
+				queue.m_tail->m_next = transfer;
+			else
+				queue.m_head = transfer;
+			queue.m_tail = transfer;
+			pthread_cond_signal(&queue.m_ready);
+			pthread_mutex_unlock(&queue.m_mutex);
+		}
+		pthread_mutex_lock(&batch.m_mutex);
+		while (batch.m_left > 0)
+			pthread_cond_wait(&batch.m_done, &batch.m_mutex);
+		pthread_mutex_unlock(&batch.m_mutex);
+		pthread_mutex_destroy(&batch.m_mutex);
+		pthread_cond_destroy(&batch.m_done);
+	}
+};
+#endif /* RAID_PARALLEL_IO */
+
+/**
+ * @brief: Where a volume sector is stored
+ */
+struct SAddress {
+	int m_sector;
+	int m_row;
+	// first row of the stripe of the sector
+	int m_stripeRow;
+	// the data sectors of a row are counted, the parity is not
+	int m_column;
+	int m_disk;
+	int m_parityDisk;
+};
+
+/**
+ * @brief: Maps the volume sectors to the devices, built at start from the device count and the layout
+ * @note: Right asymmetric: parity moves from the first device to the last, data fills the rest in order.
+ * Left symmetric: parity moves from the last device to the first, data starts right after it and wraps,
+ * so consecutive chunks land on all the devices in turn.
+ * A single address costs a few divisions, next() walks to the following sector without any
+ */
+class CStripeMap {
+private:
+	int m_devices;
+	int m_chunkSectors;
+	int m_layout;
+	int m_stripeSectors;
+
+public:
+	CStripeMap() : m_devices(3), m_chunkSectors(1), m_layout(LAYOUT_RIGHT_ASYMMETRIC), m_stripeSectors(2) {}
+
+	void init(int devices, int chunkSectors, int layout) {
+		m_devices = devices;
+		m_chunkSectors = chunkSectors;
+		m_layout = layout;
+		m_stripeSectors = chunkSectors * (devices - 1);
+	}
+
+	// a stripe is m_chunkSectors rows, every data device holds a chunk of consecutive volume sectors in it
+	int stripeSectors() const {
+		return m_stripeSectors;
+	}
+
+	int row(int sector) const {
+		return sector / m_stripeSectors * m_chunkSectors + sector % m_chunkSectors;
+	}
+
+	int column(int sector) const {
+		return sector % m_stripeSectors / m_chunkSectors;
+	}
+
+	int parityByRow(int row) const {
+		int stripe = row / m_chunkSectors;
+		if (m_layout == LAYOUT_LEFT_SYMMETRIC)
+			return m_devices - 1 - stripe % m_devices;
+		return stripe % m_devices;
+	}
+
+	/**
+	 * @returns: The device holding the first data sector of a row with the parity on parityDisk
+	 */
+	int firstDisk(int parityDisk) const {
+		if (m_layout == LAYOUT_LEFT_SYMMETRIC)
+			return parityDisk + 1 < m_devices ? parityDisk + 1 : 0;
+		return parityDisk == 0 ? 1 : 0;
+	}
+
+	/**
+	 * @returns: The device holding the data sector of a row that follows the one on disk
+	 */
+	int nextDisk(int disk, int parityDisk) const {
+		if (m_layout == LAYOUT_LEFT_SYMMETRIC)
+			return disk + 1 < m_devices ? disk + 1 : 0;
+		return disk + 1 == parityDisk ? disk + 2 : disk + 1;
+	}
+
+	/**
+	 * @returns: The device holding the column-th data sector of a row
+	 */
+	int deviceByColumn(int row, int column) const {
+		int parity = parityByRow(row);
+		if (m_layout == LAYOUT_LEFT_SYMMETRIC)
+			return (parity + 1 + column) % m_devices;
+		return column >= parity ? column + 1 : column;
+	}
+
+	/**
+	 * @returns: The volume sector stored in the column-th data sector of a row
+	 */
+	int sector(int row, int column) const {
+		return row / m_chunkSectors * m_stripeSectors + column * m_chunkSectors + row % m_chunkSectors;
+	}
+
+	SAddress at(int sector) const {
+		SAddress res;
+		res.m_sector = sector;
+		res.m_row = row(sector);
+		res.m_stripeRow = res.m_row - res.m_row % m_chunkSectors;
+		res.m_column = column(sector);
+		res.m_parityDisk = parityByRow(res.m_row);
+		res.m_disk = deviceByColumn(res.m_row, res.m_column);
+		return res;
+	}
+
+	/**
+	 * @brief: Moves an address to the next volume sector: down the chunk, then to the next column, then to the next stripe
+	 */
+	void next(SAddress &at) const {
+		++at.m_sector;
+		if (++at.m_row < at.m_stripeRow + m_chunkSectors)
+			return;
+		at.m_row = at.m_stripeRow;
+		if (++at.m_column < m_devices - 1) {
+			at.m_disk = nextDisk(at.m_disk, at.m_parityDisk);
+			return;
+		}
+		at.m_column = 0;
+		at.m_row = at.m_stripeRow += m_chunkSectors;
+		if (m_layout == LAYOUT_LEFT_SYMMETRIC)
+			at.m_parityDisk = at.m_parityDisk > 0 ? at.m_parityDisk - 1 : m_devices - 1;
+		else
+			at.m_parityDisk = at.m_parityDisk + 1 < m_devices ? at.m_parityDisk + 1 : 0;
+		at.m_disk = firstDisk(at.m_parityDisk);
+	}
+};
+
+class CRaidVolume {
+protected:
+	TBlkDev m_dev;
+	bool m_hasDev;
+	SOverhead m_overhead;
+	CStripeMap m_map;
+	CAtomicInt m_RAIDStatus;
+	// disk that resync is writing to right now, -1 otherwise
+	CAtomicInt m_rebuilding;
+	// rows of m_rebuilding below the cursor are rebuilt, a returning disk (m_rebuildDirtyOnly) is stale in its dirty regions only
+	int m_rebuildCursor;
+	bool m_rebuildDirtyOnly;
+
+	// with RAID_THREAD_SAFE: m_volumeLock keeps start/stop/resync/flush away from reads and writes,
+	// m_rangeLock serializes the rows of overlapping requests, m_cacheLock guards m_cache and
+	// m_statusLock the overhead and the write-intent bitmap, taken in this order
+	CVolumeLock m_volumeLock;
+	CRangeLock m_rangeLock;
+	CMutex m_cacheLock;
+	CMutex m_statusLock;
+
+	// write-intent bitmap, a bit per m_regionRows rows written while m_overhead.m_intentDisk was missing
+	uint8_t m_intent[SECTOR_SIZE];
+	int m_regionRows;
+	// the overhead on the disks already knows about the bitmap
+	bool m_intentSaved;
+	// allocation bitmap, a bit per m_regionRows rows that were ever written; the rest is zero on every disk
+	uint8_t m_written[SECTOR_SIZE];
+
+	// staging buffers, every device has a run of m_stageRows sectors in one
+	CStagePool m_stages;
+	int m_stageRows;
+
+	uint8_t *stageSector(uint8_t *stage, int disk, int rowOffset) const {
+		return stage + (disk * m_stageRows + rowOffset) * SECTOR_SIZE;
+	}
+
+	// write-back cache of partially written rows, a sector not valid in a cached stripe is up to date on its device
+	CStripeCache m_cache;
+	int m_cacheBytes;
+
+	// with RAID_THREAD_SAFE m_readAheadLock is taken before the range lock by reads, after it was released by writes
+	CReadAhead m_readAhead;
+	CMutex m_readAheadLock;
+	int m_readAheadBytes;
+
+#ifdef RAID_PARALLEL_IO
+	CIOEngine m_io;
+#endif
+
+	CIOStats m_stats;
+
+	void markFailDisk(int disk) {
+		CGuard guard(m_statusLock);
+		if (disk == m_rebuilding) {
+			// the disk was not part of the array yet, the array stays degraded;
+			// whatever got written there can't be trusted, so there is no checkpoint or bitmap for it anymore
+			m_overhead.m_status.setStatus(disk, false);
+			m_rebuilding = -1;
+			m_overhead.m_rebuildDisk = -1;
+			m_overhead.m_intentDisk = -1;
+			flushOverhead();
+			return;
+		}
+		if (m_overhead.m_status.getStatus(disk)) {
+			if (m_RAIDStatus == RAID_OK)
+				startIntent(disk, m_overhead.m_version);
+			m_overhead.m_status.setStatus(disk, false);
+			m_RAIDStatus = m_RAIDStatus == RAID_OK ? RAID_DEGRADED : RAID_FAILED;
+		}
+	}
+
+	/**
+	 * @returns: True when rows [row, row + count) of a device can be read; the rows of m_rebuilding the rebuild did not
+	 * get to yet are stale, they are recovered from the other disks instead
+	 * @note: Writes go to m_rebuilding whenever it is alive, the data they bring is right wherever the cursor is
+	 */
+	bool readable(int disk, int row, int count) {
+		if (!m_overhead.m_status.getStatus(disk))
+			return false;
+		if (disk != m_rebuilding || row + count <= m_rebuildCursor || row >= dataRows())
+			return true;
+		if (!m_rebuildDirtyOnly)
+			return false;
+		// a returning disk misses the dirty regions only
+		CGuard guard(m_statusLock);
+		int from = row > m_rebuildCursor ? row : m_rebuildCursor;
+		int to = row + count < dataRows() ? row + count : dataRows();
+		for (int region = from / m_regionRows; region <= (to - 1) / m_regionRows; ++region)
+			if (isDirty(region))
+				return false;
+		return true;
+	}
+
+	/**
+	 * @brief: Reads data from a sector of a device, no matter if it's overhead or parity
+	 * @note: buffer has to be provided
+	 */
+	bool readSector(int dev, int row, uint8_t *buf, int length = 1) {
+		if (!readable(dev, row, length))
+			return false;
+		uint64_t start = CIOStats::now();
+		bool toRet = m_dev.m_Read(dev, row, buf, length) == length;
+		m_stats.transfer(dev, false, length, CIOStats::now() - start);
+		if (!toRet)
+			markFailDisk(dev);
+		return toRet;
+	}
+	/**
+	 * @brief: Writes data from buffer to a sector of a device, no matter if it's overhead or parity
+	 * @note: buffer has to be provided
+	 */
+	bool writeSector(int dev, int row, const uint8_t *buf, int length = 1) {
+		if (!m_overhead.m_status.getStatus(dev))
+			return false;
+		uint64_t start = CIOStats::now();
+		bool toRet = m_dev.m_Write(dev, row, buf, length) == length;
+		m_stats.transfer(dev, true, length, CIOStats::now() - start);
+		if (!toRet)
+			markFailDisk(dev);
+		return toRet;
+	}
+
+	/**
+	 * @brief: Runs transfers, the ones on different devices at the same time when built with RAID_PARALLEL_IO
+	 * @note: Same rules as readSector/writeSector: a failed device is not touched, a failing one is marked
+	 * (in the calling thread, once all the transfers finished)
+	 */
+	void transferAll(STransfer *transfers, int cnt) {
+		for (int i = 0; i < cnt; ++i) {
+			transfers[i].m_issued = transfers[i].m_write ? m_overhead.m_status.getStatus(transfers[i].m_disk) : readable(transfers[i].m_disk, transfers[i].m_sector, transfers[i].m_count);
+			transfers[i].m_ok = false;
+		}
+#ifdef RAID_PARALLEL_IO
+		m_io.run(transfers, cnt);
+#else
+		for (int i = 0; i < cnt; ++i)
+			if (transfers[i].m_issued)
+				transfers[i].run(m_dev);
+#endif
+		for (int i = 0; i < cnt; ++i) {
+			if (!transfers[i].m_issued)
+				continue;
+			m_stats.transfer(transfers[i].m_disk, transfers[i].m_write, transfers[i].m_count, transfers[i].m_nanos);
+			if (!transfers[i].m_ok)
+				markFailDisk(transfers[i].m_disk);
+		}
+	}
+
+	/**
+	 * @returns: The rows of a device available for data, the last incomplete stripe is not used
+	 */
+	int dataRows() const {
+		return (m_dev.m_Sectors - OVERHEAD_SECTORS) / m_overhead.m_chunkSectors * m_overhead.m_chunkSectors;
+	}
+
+	int stripeSectors() const {
+		return m_map.stripeSectors();
+	}
+
+	int getRow(int sector) const {
+		return m_map.row(sector);
+	}
+
+	int getColumn(int sector) const {
+		return m_map.column(sector);
+	}
+
+	int getParityDevByRow(int row) const {
+		return m_map.parityByRow(row);
+	}
+
+	int getSector(int row, int column) const {
+		return m_map.sector(row, column);
+	}
+
+	/**
+	 * @brief: Finds the rows holding volume sectors [secFrom, secTo), may be a few rows more
+	 */
+	void getRows(int secFrom, int secTo, int &rowFrom, int &rowTo) const {
+		int chunk = m_overhead.m_chunkSectors;
+		int last = secTo - 1;
+		rowFrom = getRow(secFrom);
+		rowTo = getRow(last) + 1;
+		// the next chunk of the stripe starts at its first row
+		if (getColumn(secFrom) < m_dev.m_Devices - 2 && secTo > secFrom - secFrom % chunk + chunk)
+			rowFrom -= secFrom % chunk;
+		// the previous chunk of the stripe ends at its last row
+		if (getColumn(last) > 0 && secFrom < last - last % chunk)
+			rowTo += chunk - 1 - last % chunk;
+	}
+
+	bool getOverhead(int dev, SOverhead &overhead) {
+		uint8_t buf[SECTOR_SIZE];
+		bool result = readSector(dev, m_dev.m_Sectors - 1, buf);
+		if (!result)
+			return false;
+		mymemcpy(&overhead, buf, sizeof(SOverhead));
+		return true;
+	}
+	bool setOverhead(int dev, const SOverhead &overhead) {
+		uint8_t buf[SECTOR_SIZE];
+		mymemcpy(buf, &overhead, sizeof(SOverhead));
+		return writeSector(dev, m_dev.m_Sectors - 1, buf);
+	}
+
+	/**
+	 * @brief: Writes a new version of the overhead to all valid disks
+	 * @note: The disk being rebuilt is written as failed, so a crash does not make it valid
+	 */
+	void flushOverhead() {
+		CGuard guard(m_statusLock);
+		++m_overhead.m_version;
+		for (int disk = 0; disk < m_dev.m_Devices;) {
+			SOverhead saved = m_overhead;
+			if (m_rebuilding != -1)
+				saved.m_status.setStatus(m_rebuilding, false);
+			if (disk != m_rebuilding && saved.m_status.getStatus(disk) && !setOverhead(disk, saved)) {
+				// update overhead and start over
+				markFailDisk(disk);
+				++m_overhead.m_version;
+				disk = 0;
+				continue;
+			}
+			++disk;
+		}
+	}
+
+	/**
+	 * @brief: Persists the progress of the rebuild of disk m_rebuilding
+	 * @note: The rebuilt disk gets a marker with version 0 (never trusted by start), so a resumed
+	 * rebuild can tell it apart from a replaced disk
+	 */
+	void saveCheckpoint() {
+		SOverhead marker = m_overhead;
+		marker.m_version = 0;
+		setOverhead(m_rebuilding, marker);
+		flushOverhead();
+	}
+
+	/**
+	 * @returns: The row the rebuild of a disk can start at
+	 * @param marker: overhead loaded from the disk
+	 */
+	int resumeRow(int disk, const SOverhead &marker) const {
+		if (m_overhead.m_rebuildDisk != disk || marker.m_version != 0 || marker.m_rebuildDisk != disk || marker.m_rebuildId != m_overhead.m_rebuildId)
+			return 0; // no checkpoint or a different disk
+		return marker.m_rebuildRow < m_overhead.m_rebuildRow ? marker.m_rebuildRow : m_overhead.m_rebuildRow;
+	}
+
+	/**
+	 * @brief: Starts tracking the writes a dropped disk misses
+	 * @param base: version of the overhead the disk has
+	 */
+	void startIntent(int disk, size_t base) {
+		m_overhead.m_intentDisk = disk;
+		m_overhead.m_intentBase = base;
+		for (int i = 0; i < SECTOR_SIZE; ++i)
+			m_intent[i] = 0;
+		m_intentSaved = false;
+	}
+
+	bool isDirty(int region) const {
+		return (m_intent[region / 8] >> (region % 8)) & 0b1;
+	}
+
+	/**
+	 * @brief: Records that rows [rowFrom, rowTo) are about to be written while a disk is missing
+	 * @note: The bitmap is on the disks before the data, so a crash can't lose a dirty region
+	 */
+	void markIntent(int rowFrom, int rowTo) {
+		CGuard guard(m_statusLock);
+		if (m_RAIDStatus != RAID_DEGRADED || m_overhead.m_intentDisk == -1 || rowFrom >= rowTo)
+			return;
+		bool changed = !m_intentSaved;
+		for (int region = rowFrom / m_regionRows; region <= (rowTo - 1) / m_regionRows; ++region)
+			if (!isDirty(region)) {
+				m_intent[region / 8] |= 0b1 << (region % 8);
+				changed = true;
+			}
+		if (changed)
+			saveIntent();
+	}
+
+	/**
+	 * @brief: Writes the write-intent bitmap to all valid disks, the overhead follows the first time
+	 */
+	void saveIntent() {
+		STransfer transfers[MAX_RAID_DEVICES];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			transfers[disk] = STransfer(disk, m_dev.m_Sectors - INTENT_SECTOR_BACK, m_intent, 1, true);
+		transferAll(transfers, m_dev.m_Devices);
+		if (!m_intentSaved) {
+			flushOverhead();
+			m_intentSaved = true;
+		}
+	}
+
+	/**
+	 * @returns: True when the disk only dropped out for a while, so it only misses the dirty regions
+	 * @param loaded: overhead loaded from the disk
+	 */
+	bool isReturning(int disk, const SOverhead &loaded) const {
+		return m_overhead.m_intentDisk == disk && loaded.m_version != 0 && loaded.m_version == m_overhead.m_intentBase;
+	}
+
+	bool isWritten(const uint8_t *bitmap, int row) const {
+		int region = row / m_regionRows;
+		return (bitmap[region / 8] >> (region % 8)) & 0b1;
+	}
+
+	/**
+	 * @returns: The end of the run of rows from rowFrom that are all written or all never written, at most rowTo
+	 */
+	int writtenRun(const uint8_t *bitmap, int rowFrom, int rowTo) const {
+		bool written = isWritten(bitmap, rowFrom);
+		int row = (rowFrom / m_regionRows + 1) * m_regionRows;
+		while (row < rowTo && isWritten(bitmap, row) == written)
+			row += m_regionRows;
+		return row < rowTo ? row : rowTo;
+	}
+
+	/**
+	 * @brief: Copies the allocation bitmap, writes may mark more regions right after
+	 */
+	void snapshotWritten(uint8_t *bitmap) {
+		CGuard guard(m_statusLock);
+		mymemcpy(bitmap, m_written, SECTOR_SIZE);
+	}
+
+	/**
+	 * @brief: Records that rows [rowFrom, rowTo) are about to be written
+	 * @note: The bitmap is on the disks before the data, a region the disks say was never written has to be zero
+	 */
+	void markWritten(int rowFrom, int rowTo) {
+		CGuard guard(m_statusLock);
+		bool changed = false;
+		for (int region = rowFrom / m_regionRows; region <= (rowTo - 1) / m_regionRows; ++region)
+			if (!isWritten(m_written, region * m_regionRows)) {
+				m_written[region / 8] |= 0b1 << (region % 8);
+				changed = true;
+			}
+		if (changed)
+			saveWritten();
+	}
+
+	void saveWritten() {
+		STransfer transfers[MAX_RAID_DEVICES];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			transfers[disk] = STransfer(disk, m_dev.m_Sectors - WRITTEN_SECTOR_BACK, m_written, 1, true);
+		transferAll(transfers, m_dev.m_Devices);
+	}
+
+	/**
+	 * @brief: Loads the allocation bitmap, a region written according to any of the disks counts as written
+	 */
+	void loadWritten() {
+		for (int i = 0; i < SECTOR_SIZE; ++i)
+			m_written[i] = 0;
+		uint8_t bitmap[SECTOR_SIZE];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (readSector(disk, m_dev.m_Sectors - WRITTEN_SECTOR_BACK, bitmap))
+				for (int i = 0; i < SECTOR_SIZE; ++i)
+					m_written[i] |= bitmap[i];
+	}
+
+	/**
+	 * @brief: Brings the first missing disk back as m_rebuilding, a returning one only needs its dirty regions
+	 * @returns: False when the disk can't be read, markFailDisk dropped it again then
+	 */
+	bool beginRebuild() {
+		int toRecover = -1;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (!m_overhead.m_status.getStatus(disk)) {
+				toRecover = disk;
+				break;
+			}
+		if (toRecover == -1) {
+#ifndef __PROGTEST__
+			throw logic_error("RAID says degraded, but all disks are ok, which is not possible");
+#else
+			return false;
+#endif
+		}
+
+		m_overhead.m_status.setStatus(toRecover, true);
+		m_rebuildCursor = 0;
+		m_rebuildDirtyOnly = false;
+		m_rebuilding = toRecover;
+		SOverhead loaded;
+		if (!getOverhead(toRecover, loaded))
+			return false;
+		if (isReturning(toRecover, loaded)) {
+			m_rebuildDirtyOnly = true;
+			return true;
+		}
+
+		// continues from the checkpoint when there is one for this disk
+		int rowFrom = resumeRow(toRecover, loaded);
+		if (rowFrom == 0) {
+			m_overhead.m_rebuildDisk = toRecover;
+			m_overhead.m_rebuildId = m_overhead.m_version + 1;
+		}
+		m_overhead.m_rebuildRow = m_rebuildCursor = rowFrom;
+		// every row gets rebuilt, a bitmap of the writes would not spare any
+		m_overhead.m_intentDisk = -1;
+		return true;
+	}
+
+	/**
+	 * @brief: Rebuilds the next dirty regions of a returning m_rebuilding, clean regions are skipped for free
+	 * @param maxRows: the rows to rebuild at most, at least a region is rebuilt
+	 */
+	void rebuildDirty(int maxRows, uint8_t *stage) {
+		int regions = (dataRows() + m_regionRows - 1) / m_regionRows;
+		int rebuilt = 0;
+		while (m_rebuildCursor < dataRows() && rebuilt < maxRows && m_rebuilding != -1) {
+			int region = m_rebuildCursor / m_regionRows;
+			if (!isDirty(region)) {
+				m_rebuildCursor = (region + 1) * m_regionRows < dataRows() ? (region + 1) * m_regionRows : dataRows();
+				continue;
+			}
+			// neighbouring dirty regions are rebuilt together
+			int last = region;
+			while (last + 1 < regions && isDirty(last + 1) && (last + 1 - region) * m_regionRows < maxRows - rebuilt)
+				++last;
+			int rowTo = (last + 1) * m_regionRows < dataRows() ? (last + 1) * m_regionRows : dataRows();
+			if (!rebuildRows(m_rebuilding, m_rebuildCursor, rowTo, stage))
+				break;
+			rebuilt += rowTo - m_rebuildCursor;
+			m_rebuildCursor = rowTo;
+		}
+	}
+
+	/**
+	 * @brief: Rebuilds the next maxRows rows of m_rebuilding, the checkpoint follows every CHECKPOINT_ROWS rows
+	 */
+	void rebuildFull(int maxRows, uint8_t *stage) {
+		int rowTo = m_rebuildCursor + maxRows < dataRows() ? m_rebuildCursor + maxRows : dataRows();
+		while (m_rebuildCursor < rowTo && m_rebuilding != -1) {
+			int next = (m_rebuildCursor / CHECKPOINT_ROWS + 1) * CHECKPOINT_ROWS;
+			next = next < rowTo ? next : rowTo;
+			if (!rebuildRows(m_rebuilding, m_rebuildCursor, next, stage))
+				break;
+			m_rebuildCursor = next;
+			if (next % CHECKPOINT_ROWS == 0 && next < dataRows()) {
+				m_overhead.m_rebuildRow = next;
+				saveCheckpoint();
+			}
+		}
+	}
+
+	/**
+	 * @brief: A write while the rebuilt disk is missing makes its rows from row on stale
+	 */
+	void invalidateCheckpoint(int row) {
+		CGuard guard(m_statusLock);
+		if (m_overhead.m_rebuildDisk == -1 || m_rebuilding != -1 || row >= m_overhead.m_rebuildRow)
+			return;
+		m_overhead.m_rebuildRow = row;
+		flushOverhead();
+	}
+
+	/**
+	 * @brief: Reads the sectors of the wanted devices that are not valid in a cached stripe yet
+	 * @returns: The device that could not be read, -1 when there is none, -2 when there are more of them
+	 */
+	int readColumns(int slot, CStatus wanted) {
+		STransfer transfers[MAX_RAID_DEVICES];
+		int cnt = 0;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (wanted.getStatus(disk) && !m_cache.valid(slot).getStatus(disk))
+				transfers[cnt++] = STransfer(disk, m_cache.row(slot), m_cache.sector(slot, disk));
+		transferAll(transfers, cnt);
+		int lost = -1;
+		for (int i = 0; i < cnt; ++i) {
+			if (transfers[i].m_ok)
+				m_cache.valid(slot).setStatus(transfers[i].m_disk, true);
+			else
+				lost = lost == -1 ? transfers[i].m_disk : -2;
+		}
+		return lost;
+	}
+
+	/**
+	 * @brief: Makes the sectors of the wanted devices in a cached stripe valid
+	 * @note: A sector that can't be read is recovered from the rest of the stripe
+	 */
+	bool loadColumns(int slot, CStatus wanted) {
+		int lost = readColumns(slot, wanted);
+		if (lost == -1)
+			return true;
+		if (lost == -2 || m_RAIDStatus == RAID_FAILED)
+			return false;
+		CStatus rest(0xffff >> (16 - m_dev.m_Devices));
+		rest.setStatus(lost, false);
+		if (readColumns(slot, rest) != -1)
+			return false;
+		const uint8_t *src[MAX_RAID_DEVICES];
+		int srcCnt = 0;
+		for (int other = 0; other < m_dev.m_Devices; ++other)
+			if (other != lost)
+				src[srcCnt++] = m_cache.sector(slot, other);
+		XORBlocks(m_cache.sector(slot, lost), src, srcCnt, SECTOR_SIZE);
+		m_cache.valid(slot).setStatus(lost, true);
+		m_stats.reconstructed(lost, 1);
+		return true;
+	}
+
+	bool loadColumn(int slot, int disk) {
+		CStatus wanted;
+		wanted.setStatus(disk, true);
+		return loadColumns(slot, wanted);
+	}
+
+	/**
+	 * @returns: The cached stripe of a row, -1 when making room for it failed the RAID
+	 */
+	int getStripe(int row, uint8_t *stage) {
+		int slot = m_cache.find(row);
+		if (slot == -1) {
+			int victim = m_cache.victim();
+			// under pressure everything dirty goes out at once, in the order of rows
+			if (victim != -1 && m_cache.dirty(victim) != CStatus() && !flushCache(stage, 0, dataRows()))
+				return -1;
+			slot = m_cache.insert(row);
+		}
+		m_cache.touch(slot);
+		return slot;
+	}
+
+	/**
+	 * @brief: Writes the dirty sectors of the cached stripes of rows [rowFrom, rowTo), consecutive rows of a device in one call
+	 * @returns: False when the RAID failed
+	 */
+	bool flushCache(uint8_t *stage, int rowFrom, int rowTo) {
+		CGuard guard(m_cacheLock);
+		if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
+			return false;
+		int count;
+		const int *order = m_cache.sortedDirty(count, rowFrom, rowTo);
+		if (count == 0)
+			return true;
+		int statusBefore = m_RAIDStatus;
+		{
+			CGuard statusGuard(m_statusLock);
+			if (m_RAIDStatus == RAID_DEGRADED && m_overhead.m_intentDisk != -1) {
+				// rows cached before the disk dropped out are not in the bitmap yet
+				int missedFrom = -1, missedTo = -1;
+				for (int i = 0; i < count; ++i)
+					if (m_cache.dirty(order[i]).getStatus(m_overhead.m_intentDisk)) {
+						missedFrom = missedFrom == -1 ? m_cache.row(order[i]) : missedFrom;
+						missedTo = m_cache.row(order[i]) + 1;
+					}
+				markIntent(missedFrom, missedTo);
+			}
+		}
+		// runs of all the devices go out together, whenever the stage of a device is full
+		STransfer transfers[STAGE_SECTORS];
+		int cnt = 0;
+		int used[MAX_RAID_DEVICES] = {};
+		int next[MAX_RAID_DEVICES] = {};
+		for (bool pending = true; pending;) {
+			pending = false;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+				int i = next[disk];
+				while (i < count && !m_cache.dirty(order[i]).getStatus(disk))
+					++i;
+				if (i == count || !m_overhead.m_status.getStatus(disk))
+					continue;
+				pending = true;
+				int rowFrom = m_cache.row(order[i]);
+				int runEnd = i;
+				while (runEnd < count && used[disk] + runEnd - i < m_stageRows && m_cache.row(order[runEnd]) == rowFrom + runEnd - i && m_cache.dirty(order[runEnd]).getStatus(disk)) {
+					mymemcpy(stageSector(stage, disk, used[disk] + runEnd - i), m_cache.sector(order[runEnd], disk), SECTOR_SIZE);
+					++runEnd;
+				}
+				if (runEnd == i) {
+					// the stage of the device is full
+					transferAll(transfers, cnt);
+					cnt = 0;
+					for (int other = 0; other < m_dev.m_Devices; ++other)
+						used[other] = 0;
+					continue;
+				}
+				transfers[cnt++] = STransfer(disk, rowFrom, stageSector(stage, disk, used[disk]), runEnd - i, true);
+				used[disk] += runEnd - i;
+				next[disk] = runEnd;
+			}
+		}
+		transferAll(transfers, cnt);
+		// sectors of a failed device stay valid, they can't be recovered from its device anymore
+		for (int i = 0; i < count; ++i)
+			m_cache.dirty(order[i]) = CStatus();
+		// a disk dropped out during the flush, it may have missed any of the rows
+		if (statusBefore == RAID_OK && m_RAIDStatus == RAID_DEGRADED)
+			markIntent(m_cache.row(order[0]), m_cache.row(order[count - 1]) + 1);
+		return m_RAIDStatus == RAID_OK || m_RAIDStatus == RAID_DEGRADED;
+	}
+
+	/**
+	 * @brief: Finds the rows of each device a way of updating the parity of rows [rowFrom, rowTo) of a stripe reads
+	 * @param reconstruct: a reconstruct-write reads the data the rows keep, a read-modify-write the old data and parity
+	 * @param lo, hi: rows [lo, hi) of a device get new data, lo == hi for the devices that keep theirs
+	 * @param slots: the cached stripes of the rows, their valid sectors are not read; nullptr without the cache
+	 * @param readFrom, readTo: a single run per device, it may cover a few rows the way does not need
+	 * @returns: The sectors to read, -1 when a run can't be read
+	 */
+	int spanReads(bool reconstruct, int rowFrom, int rowTo, int parityDisk, const int *lo, const int *hi, const int *slots, int *readFrom, int *readTo) {
+		int total = 0;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			readFrom[disk] = readTo[disk] = rowFrom;
+			for (int row = rowFrom; row < rowTo; ++row) {
+				bool written = row >= lo[disk] && row < hi[disk];
+				if (!(disk == parityDisk ? !reconstruct : written != reconstruct))
+					continue;
+				if (slots && m_cache.valid(slots[row - rowFrom]).getStatus(disk))
+					continue;
+				if (readFrom[disk] == readTo[disk])
+					readFrom[disk] = row;
+				readTo[disk] = row + 1;
+			}
+			if (readFrom[disk] == readTo[disk])
+				continue;
+			if (total != -1 && readable(disk, readFrom[disk], readTo[disk] - readFrom[disk]))
+				total += readTo[disk] - readFrom[disk];
+			else
+				total = -1;
+		}
+		return total;
+	}
+
+	/**
+	 * @brief: Picks how rows [rowFrom, rowTo) of a stripe update their parity, by the sectors each way has to read
+	 * @returns: 1 for a reconstruct-write (the other data is read, the parity is computed from the whole rows),
+	 * 0 for a read-modify-write (the old data and parity are read, the parity is updated),
+	 * -1 when a missing device rules out both, it gets new data in some of the rows and keeps the others
+	 */
+	int updateWay(int rowFrom, int rowTo, int parityDisk, const int *lo, const int *hi, const int *slots) {
+		int readFrom[MAX_RAID_DEVICES], readTo[MAX_RAID_DEVICES];
+		int rmw = spanReads(false, rowFrom, rowTo, parityDisk, lo, hi, slots, readFrom, readTo);
+		int rcw = spanReads(true, rowFrom, rowTo, parityDisk, lo, hi, slots, readFrom, readTo);
+		if (rmw == -1 && rcw == -1)
+			return -1;
+		return rcw != -1 && (rmw == -1 || rcw < rmw) ? 1 : 0;
+	}
+
+	/**
+	 * @returns: The first row after rowFrom where the devices getting new data change, rowTo when they don't
+	 */
+	int splitRow(int rowFrom, int rowTo, const int *lo, const int *hi) const {
+		int cut = rowTo;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			if (lo[disk] > rowFrom && lo[disk] < cut)
+				cut = lo[disk];
+			if (hi[disk] > rowFrom && hi[disk] < cut)
+				cut = hi[disk];
+		}
+		return cut;
+	}
+
+	/**
+	 * @returns: True when a device gets new data in the row
+	 */
+	bool rowWritten(int row, const int *lo, const int *hi) const {
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (row >= lo[disk] && row < hi[disk])
+				return true;
+		return false;
+	}
+
+	/**
+	 * @brief: Writes a part of a row into its cached stripe, the parity is updated in the cache too
+	 * @param rowData: new data by device, nullptr for the devices the row keeps
+	 * @param reconstruct: the way the parity is updated, see updateWay
+	 * @note: The sectors the way needs were mostly loaded by writeSpanCached, the rest is read or recovered here
+	 */
+	bool writeRowCached(int slot, int parityDisk, const uint8_t *const *rowData, bool reconstruct) {
+		CStatus written;
+		int cnt = 0;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (rowData[disk]) {
+				written.setStatus(disk, true);
+				++cnt;
+			}
+		// without the parity the data is all there is to write
+		bool parityAlive = m_overhead.m_status.getStatus(parityDisk);
+		reconstruct = reconstruct && parityAlive;
+		CStatus wanted;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			wanted.setStatus(disk, parityAlive && (disk == parityDisk ? !reconstruct : written.getStatus(disk) != reconstruct));
+		if (!loadColumns(slot, wanted))
+			return false;
+		if (reconstruct)
+			m_stats.rcwWrites(cnt);
+		else
+			m_stats.rmwWrites(cnt);
+
+		uint8_t *parity = m_cache.sector(slot, parityDisk);
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			if (!rowData[disk])
+				continue;
+			uint8_t *cached = m_cache.sector(slot, disk);
+			if (parityAlive && !reconstruct) {
+				const uint8_t *src[3] = {parity, cached, rowData[disk]};
+				XORBlocks(parity, src, 3, SECTOR_SIZE);
+			}
+			mymemcpy(cached, rowData[disk], SECTOR_SIZE);
+			m_cache.valid(slot).setStatus(disk, true);
+			m_cache.dirty(slot).setStatus(disk, true);
+		}
+		if (!parityAlive) {
+			// parity is failed, resync recomputes it
+			m_cache.valid(slot).setStatus(parityDisk, false);
+			m_cache.dirty(slot).setStatus(parityDisk, false);
+			return true;
+		}
+		if (reconstruct) {
+			const uint8_t *src[MAX_RAID_DEVICES];
+			int srcCnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (disk != parityDisk)
+					src[srcCnt++] = m_cache.sector(slot, disk);
+			XORBlocks(parity, src, srcCnt, SECTOR_SIZE);
+			m_cache.valid(slot).setStatus(parityDisk, true);
+		}
+		m_cache.dirty(slot).setStatus(parityDisk, true);
+		return true;
+	}
+
+	/**
+	 * @brief: Writes rows [rowFrom, rowTo) of a stripe into their cached stripes, one way of updating the parity for all of them
+	 * @param lo, hi, sectors: see writeStripePart
+	 * @param fresh: the rows were never written, so they are zero on all the devices
+	 * @note: What the way reads goes through the stage, a run per device, repeated writes to a row only read it once
+	 */
+	bool writeSpanCached(int rowFrom, int rowTo, int parityDisk, const int *lo, const int *hi, const int *sectors, const CSegments &data, uint8_t *stage, bool fresh) {
+		CGuard guard(m_cacheLock);
+		int slots[STAGE_SECTORS];
+		for (int row = rowFrom; row < rowTo; ++row) {
+			int slot = getStripe(row, stage);
+			if (slot == -1)
+				return false;
+			if (fresh && m_cache.valid(slot) == CStatus()) {
+				for (int other = 0; other < m_dev.m_Devices; ++other) {
+					for (int i = 0; i < SECTOR_SIZE; ++i)
+						m_cache.sector(slot, other)[i] = 0;
+					m_cache.valid(slot).setStatus(other, true);
+				}
+			}
+			slots[row - rowFrom] = slot;
+		}
+		bool parityAlive = m_overhead.m_status.getStatus(parityDisk);
+		int way = parityAlive ? updateWay(rowFrom, rowTo, parityDisk, lo, hi, slots) : 0;
+		if (way == -1) {
+			int cut = splitRow(rowFrom, rowTo, lo, hi);
+			if (cut < rowTo)
+				return writeSpanCached(rowFrom, cut, parityDisk, lo, hi, sectors, data, stage, fresh) && writeSpanCached(cut, rowTo, parityDisk, lo, hi, sectors, data, stage, fresh);
+			way = 0;
+		}
+		if (parityAlive) {
+			int readFrom[MAX_RAID_DEVICES], readTo[MAX_RAID_DEVICES];
+			spanReads(way == 1, rowFrom, rowTo, parityDisk, lo, hi, slots, readFrom, readTo);
+			STransfer transfers[MAX_RAID_DEVICES];
+			int cnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (readFrom[disk] < readTo[disk])
+					transfers[cnt++] = STransfer(disk, readFrom[disk], stageSector(stage, disk, readFrom[disk] - rowFrom), readTo[disk] - readFrom[disk]);
+			transferAll(transfers, cnt);
+			// a sector not valid is up to date on its device; the ones that failed are recovered by writeRowCached
+			for (int i = 0; i < cnt; ++i) {
+				if (!transfers[i].m_ok)
+					continue;
+				int disk = transfers[i].m_disk;
+				for (int row = readFrom[disk]; row < readTo[disk]; ++row) {
+					int slot = slots[row - rowFrom];
+					if (m_cache.valid(slot).getStatus(disk))
+						continue;
+					mymemcpy(m_cache.sector(slot, disk), stageSector(stage, disk, row - rowFrom), SECTOR_SIZE);
+					m_cache.valid(slot).setStatus(disk, true);
+				}
+			}
+		}
+		for (int row = rowFrom; row < rowTo; ++row) {
+			const uint8_t *rowData[MAX_RAID_DEVICES] = {};
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (row >= lo[disk] && row < hi[disk])
+					rowData[disk] = data.sector(sectors[disk] + row);
+			if (!writeRowCached(slots[row - rowFrom], parityDisk, rowData, way == 1))
+				return false;
+		}
+		return true;
 	}
-};
-
-void XORSector(uint8_t *sec1, const uint8_t *sec2) {
-	for (int i = 0; i < SECTOR_SIZE; ++i)
-		sec1[i] ^= sec2[i];
-}
 
-// maybe cstring is not included?
-void mymemcpy(void *dst, const void *src, int n) {
-	uint8_t *cdst = (uint8_t *)dst;
-	uint8_t *csrc = (uint8_t *)src;
-	for (int b = 0; b < n; ++b)
-		cdst[b] = csrc[b];
-}
+	/**
+	 * @brief: Writes rows [rowFrom, rowTo) of a stripe straight to the devices, one way of updating the parity for all of them
+	 * @param lo, hi, sectors: see writeStripePart
+	 * @param fresh: the rows were never written, their parity is the new data alone
+	 * @note: The rows are staged, so every device gets a call for its reads and one for its writes.
+	 * Either the data or the parity alone keeps the rows recoverable when the other one fails
+	 */
+	bool writeSpanDirect(int rowFrom, int rowTo, int parityDisk, const int *lo, const int *hi, const int *sectors, const CSegments &data, uint8_t *stage, bool fresh) {
+		int cnt = 0;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (lo[disk] < hi[disk])
+				cnt += (hi[disk] < rowTo ? hi[disk] : rowTo) - (lo[disk] > rowFrom ? lo[disk] : rowFrom);
+		// a device failing during the reads makes the other way the only one, every try drops one
+		for (int attempt = 0; attempt < m_dev.m_Devices && (m_RAIDStatus == RAID_OK || m_RAIDStatus == RAID_DEGRADED); ++attempt) {
+			bool parityAlive = m_overhead.m_status.getStatus(parityDisk);
+			int way = fresh ? 1 : parityAlive ? updateWay(rowFrom, rowTo, parityDisk, lo, hi, nullptr) : 0;
+			if (way == -1) {
+				int cut = splitRow(rowFrom, rowTo, lo, hi);
+				if (cut < rowTo)
+					return writeSpanDirect(rowFrom, cut, parityDisk, lo, hi, sectors, data, stage, fresh) && writeSpanDirect(cut, rowTo, parityDisk, lo, hi, sectors, data, stage, fresh);
+				way = 0;
+			}
+			bool reconstruct = way == 1;
+			int readFrom[MAX_RAID_DEVICES], readTo[MAX_RAID_DEVICES];
+			spanReads(reconstruct, rowFrom, rowTo, parityDisk, lo, hi, nullptr, readFrom, readTo);
+			STransfer transfers[MAX_RAID_DEVICES];
+			int transferCnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices && parityAlive; ++disk) {
+				if (readFrom[disk] == readTo[disk])
+					continue;
+				uint8_t *run = stageSector(stage, disk, readFrom[disk] - rowFrom);
+				if (!fresh)
+					transfers[transferCnt++] = STransfer(disk, readFrom[disk], run, readTo[disk] - readFrom[disk]);
+				else
+					for (int i = 0; i < (readTo[disk] - readFrom[disk]) * SECTOR_SIZE; ++i)
+						run[i] = 0;
+			}
+			transferAll(transfers, transferCnt);
+			bool ok = true;
+			for (int i = 0; i < transferCnt; ++i)
+				ok = ok && transfers[i].m_ok;
+			if (!ok)
+				continue;
 
-class CRaidVolume {
-protected:
-	TBlkDev m_dev;
-	bool m_hasDev;
-	SOverhead m_overhead;
-	int m_RAIDStatus;
+			transferCnt = 0;
+			uint8_t *parity = stageSector(stage, parityDisk, 0);
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+				int from = lo[disk] > rowFrom ? lo[disk] : rowFrom;
+				int to = hi[disk] < rowTo ? hi[disk] : rowTo;
+				if (from >= to)
+					continue;
+				uint8_t *run = stageSector(stage, disk, from - rowFrom);
+				// the old data cancels out of the parity, the new data goes in
+				const uint8_t *src[2] = {parity + (from - rowFrom) * SECTOR_SIZE, run};
+				if (parityAlive && !reconstruct)
+					XORBlocks(parity + (from - rowFrom) * SECTOR_SIZE, src, 2, (to - from) * SECTOR_SIZE);
+				for (int row = from; row < to; ++row)
+					mymemcpy(stageSector(stage, disk, row - rowFrom), data.sector(sectors[disk] + row), SECTOR_SIZE);
+				if (parityAlive && !reconstruct)
+					XORBlocks(parity + (from - rowFrom) * SECTOR_SIZE, src, 2, (to - from) * SECTOR_SIZE);
+				transfers[transferCnt++] = STransfer(disk, from, run, to - from, true);
+			}
+			if (parityAlive && reconstruct) {
+				const uint8_t *src[MAX_RAID_DEVICES];
+				int srcCnt = 0;
+				for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+					if (disk != parityDisk)
+						src[srcCnt++] = stageSector(stage, disk, 0);
+				XORBlocks(parity, src, srcCnt, (rowTo - rowFrom) * SECTOR_SIZE);
+			}
+			if (reconstruct)
+				m_stats.rcwWrites(cnt);
+			else
+				m_stats.rmwWrites(cnt);
 
-	void markFailDisk(int disk) {
-		if (m_overhead.m_status.getStatus(disk)) {
-			m_overhead.m_status.setStatus(disk, false);
-			m_RAIDStatus = m_RAIDStatus == RAID_OK ? RAID_DEGRADED : RAID_FAILED;
+			if (parityAlive)
+				transfers[transferCnt++] = STransfer(parityDisk, rowFrom, parity, rowTo - rowFrom, true);
+			transferAll(transfers, transferCnt);
+			return m_RAIDStatus == RAID_OK || m_RAIDStatus == RAID_DEGRADED;
 		}
+		return false;
 	}
 
 	/**
-	 * @brief: Reads data from a sector of a device, no matter if it's overhead or parity
-	 * @note: buffer has to be provided
+	 * @brief: Writes volume sectors [from, to) of a single stripe, a run of rows with new data at a time
+	 * @param written: the allocation bitmap from before the request
+	 * @note: Every run reads and writes a device at most once, the way its parity is updated is picked for the whole run
 	 */
-	bool readSector(int dev, int row, uint8_t *buf, int length = 1) {
-		if (!m_overhead.m_status.getStatus(dev))
-			return false;
-		bool toRet = m_dev.m_Read(dev, row, buf, length) == length;
-		if (!toRet)
-			markFailDisk(dev);
-		return toRet;
+	bool writeStripePart(const SAddress &from, int to, const CSegments &data, const uint8_t *written, uint8_t *stage) {
+		int parityDisk = from.m_parityDisk;
+		// rows [lo, hi) of a device get new data, volume sector sectors + row of it
+		int lo[MAX_RAID_DEVICES] = {}, hi[MAX_RAID_DEVICES] = {}, sectors[MAX_RAID_DEVICES] = {};
+		int rowFrom = from.m_stripeRow + m_overhead.m_chunkSectors, rowTo = from.m_stripeRow;
+		for (int column = 0, disk = m_map.firstDisk(parityDisk); column < m_dev.m_Devices - 1; ++column, disk = m_map.nextDisk(disk, parityDisk)) {
+			int first = getSector(from.m_stripeRow, column);
+			int secFrom = first > from.m_sector ? first : from.m_sector;
+			int secTo = first + m_overhead.m_chunkSectors < to ? first + m_overhead.m_chunkSectors : to;
+			if (secFrom >= secTo)
+				continue;
+			sectors[disk] = first - from.m_stripeRow;
+			lo[disk] = secFrom - sectors[disk];
+			hi[disk] = secTo - sectors[disk];
+			rowFrom = lo[disk] < rowFrom ? lo[disk] : rowFrom;
+			rowTo = hi[disk] > rowTo ? hi[disk] : rowTo;
+		}
+		// the rows have to fit into the stage, and into the cache next to each other
+		int maxRows = m_cache.capacity() > 0 && m_cache.capacity() < m_stageRows ? m_cache.capacity() : m_stageRows;
+		for (int row = rowFrom; row < rowTo;) {
+			if (!rowWritten(row, lo, hi)) {
+				++row;
+				continue;
+			}
+			int runEnd = row + 1;
+			while (runEnd < rowTo && runEnd - row < maxRows && rowWritten(runEnd, lo, hi))
+				++runEnd;
+			runEnd = writtenRun(written, row, runEnd);
+			bool fresh = !isWritten(written, row);
+			if (!(m_cache.capacity() > 0 ? writeSpanCached(row, runEnd, parityDisk, lo, hi, sectors, data, stage, fresh) : writeSpanDirect(row, runEnd, parityDisk, lo, hi, sectors, data, stage, fresh)))
+				return false;
+			row = runEnd;
+		}
+		return true;
 	}
+
 	/**
-	 * @brief: Writes data from buffer to a sector of a device, no matter if it's overhead or parity
-	 * @note: buffer has to be provided
+	 * @brief: Writes whole stripes, the parity is computed from the new data only, so nothing is read
+	 * @param data: holds every volume sector of the stripes, rowFrom and rowTo are at the start of a stripe
+	 * @note: Rows are staged per device, so every device gets one call per m_stageRows rows.
+	 * A failing disk is only marked, the rest of the rows stays consistent with the parity
 	 */
-	bool writeSector(int dev, int row, const uint8_t *buf, int length = 1) {
-		if (!m_overhead.m_status.getStatus(dev))
-			return false;
-		bool toRet = m_dev.m_Write(dev, row, buf, length) == length;
-		if (!toRet)
-			markFailDisk(dev);
-		return toRet;
+	bool writeFullRows(int rowFrom, int rowTo, const CSegments &data, uint8_t *stage) {
+		{
+			// the cached stripes would only hide the new rows
+			CGuard guard(m_cacheLock);
+			m_cache.drop(rowFrom, rowTo);
+		}
+		m_stats.fullStripeWrites((rowTo - rowFrom) / m_overhead.m_chunkSectors);
+		for (int chunkFrom = rowFrom; chunkFrom < rowTo; chunkFrom += m_stageRows) {
+			int chunkTo = chunkFrom + m_stageRows < rowTo ? chunkFrom + m_stageRows : rowTo;
+			for (int row = chunkFrom; row < chunkTo; ++row) {
+				const uint8_t *src[MAX_RAID_DEVICES];
+				int parityDisk = getParityDevByRow(row);
+				int sector = getSector(row, 0);
+				for (int column = 0, disk = m_map.firstDisk(parityDisk); column < m_dev.m_Devices - 1; ++column, sector += m_overhead.m_chunkSectors, disk = m_map.nextDisk(disk, parityDisk)) {
+					src[column] = data.sector(sector);
+					mymemcpy(stageSector(stage, disk, row - chunkFrom), src[column], SECTOR_SIZE);
+				}
+				XORBlocks(stageSector(stage, parityDisk, row - chunkFrom), src, m_dev.m_Devices - 1, SECTOR_SIZE);
+			}
+			STransfer transfers[MAX_RAID_DEVICES];
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				transfers[disk] = STransfer(disk, chunkFrom, stageSector(stage, disk, 0), chunkTo - chunkFrom, true);
+			transferAll(transfers, m_dev.m_Devices);
+			if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
+				return false;
+		}
+		return true;
 	}
 
-	int getRow(int sector) const {
-		return sector / (m_dev.m_Devices - 1);
+	/**
+	 * @brief: Widens the runs of all the other devices to cover the run of a missing one
+	 */
+	void coverRun(int missing, int *lo, int *hi) const {
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			if (disk == missing)
+				continue;
+			lo[disk] = lo[missing] < lo[disk] ? lo[missing] : lo[disk];
+			hi[disk] = hi[missing] > hi[disk] ? hi[missing] : hi[disk];
+		}
 	}
 
-	int getParityDevByRow(int row) const {
-		return row % m_dev.m_Devices;
+	/**
+	 * @brief: Reads rows [lo, hi) of every device but skip into the stage, rowFrom is at its start
+	 */
+	void readRuns(uint8_t *stage, int rowFrom, const int *lo, const int *hi, int skip, bool *loaded) {
+		STransfer transfers[MAX_RAID_DEVICES];
+		int cnt = 0;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			loaded[disk] = false;
+			if (disk != skip && lo[disk] < hi[disk])
+				transfers[cnt++] = STransfer(disk, lo[disk], stageSector(stage, disk, lo[disk] - rowFrom), hi[disk] - lo[disk]);
+		}
+		transferAll(transfers, cnt);
+		for (int i = 0; i < cnt; ++i)
+			loaded[transfers[i].m_disk] = transfers[i].m_ok;
 	}
 
-	int getParityDevBySector(int sector) const {
-		return getParityDevByRow(getRow(sector));
-	}
+	/**
+	 * @brief: Reads the volume sectors [secFrom, secTo) that have a buffer in data, they have to fit into m_stageRows rows
+	 * @note: Every device is read at most once, from the first to the last row it holds a wanted sector in.
+	 * The run of a failed device is recovered in one pass from the runs of the others, which are widened to cover it.
+	 * Cached stripes take precedence over the devices
+	 */
+	bool readChunk(int secFrom, int secTo, const CSegments &data, uint8_t *stage) {
+		int rowFrom, rowTo;
+		getRows(secFrom, secTo, rowFrom, rowTo);
+#ifdef RAID_THREAD_SAFE
+		// another request could flush and evict a stripe between our reads and the look into the cache,
+		// once the rows are clean (and nobody writes them, we hold them) the devices are as new as the cache
+		if (!flushCache(stage, rowFrom, rowTo))
+			return false;
+#endif
+		// rows never written read as zeros, nobody can write them while we hold them
+		uint8_t written[SECTOR_SIZE];
+		snapshotWritten(written);
+		int lo[MAX_RAID_DEVICES], hi[MAX_RAID_DEVICES];
+		bool loaded[MAX_RAID_DEVICES];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+			lo[disk] = rowTo;
+			hi[disk] = rowFrom;
+		}
+		for (SAddress at = m_map.at(secFrom); at.m_sector < secTo; m_map.next(at)) {
+			int disk = at.m_disk;
+			int row = at.m_row;
+			if (!isWritten(written, row) || !data.sector(at.m_sector))
+				continue;
+			lo[disk] = row < lo[disk] ? row : lo[disk];
+			hi[disk] = row + 1 > hi[disk] ? row + 1 : hi[disk];
+		}
 
-	int getDevice(int sector) const {
-		int device = sector % (m_dev.m_Devices - 1);
-		return device >= getParityDevBySector(sector) ? device + 1 : device;
-	}
+		int missing = -1;
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (lo[disk] < hi[disk] && !readable(disk, lo[disk], hi[disk] - lo[disk]))
+				missing = disk;
+		if (missing != -1)
+			coverRun(missing, lo, hi);
+		readRuns(stage, rowFrom, lo, hi, -1, loaded);
+		if (missing == -1)
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (lo[disk] < hi[disk] && !loaded[disk]) {
+					// failed just now, the others have to be read again with the wider runs
+					missing = disk;
+					coverRun(missing, lo, hi);
+					readRuns(stage, rowFrom, lo, hi, missing, loaded);
+					break;
+				}
 
-	bool getOverhead(int dev, SOverhead &overhead) {
-		uint8_t buf[SECTOR_SIZE];
-		bool result = readSector(dev, m_dev.m_Sectors - 1, buf);
-		if (!result)
-			return false;
-		mymemcpy(&overhead, buf, sizeof(SOverhead));
+		if (missing != -1) {
+			const uint8_t *src[MAX_RAID_DEVICES];
+			int srcCnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
+				if (disk == missing)
+					continue;
+				if (!loaded[disk])
+					return false; // m_RAIDStatus == RAID_FAILED
+				src[srcCnt++] = stageSector(stage, disk, lo[missing] - rowFrom);
+			}
+			XORBlocks(stageSector(stage, missing, lo[missing] - rowFrom), src, srcCnt, (hi[missing] - lo[missing]) * SECTOR_SIZE);
+			m_stats.reconstructed(missing, hi[missing] - lo[missing]);
+		}
+
+		CGuard guard(m_cacheLock);
+		for (SAddress at = m_map.at(secFrom); at.m_sector < secTo; m_map.next(at)) {
+			int disk = at.m_disk;
+			int row = at.m_row;
+			uint8_t *currentData = data.sector(at.m_sector);
+			if (!currentData)
+				continue;
+			if (!isWritten(written, row)) {
+				for (int i = 0; i < SECTOR_SIZE; ++i)
+					currentData[i] = 0;
+				continue;
+			}
+			int slot = m_cache.find(row);
+			// the recovered run comes from the devices, a cached stripe may be newer than them
+			if (slot != -1 && (m_cache.valid(slot).getStatus(disk) || disk == missing)) {
+				if (!loadColumn(slot, disk))
+					return false;
+				mymemcpy(currentData, m_cache.sector(slot, disk), SECTOR_SIZE);
+			} else
+				mymemcpy(currentData, stageSector(stage, disk, row - rowFrom), SECTOR_SIZE);
+		}
 		return true;
 	}
-	bool setOverhead(int dev) {
-		uint8_t buf[SECTOR_SIZE];
-		mymemcpy(buf, &m_overhead, sizeof(SOverhead));
-		return writeSector(dev, m_dev.m_Sectors - 1, buf);
-	}
 
-	bool calculateParity(uint8_t *buf, int row, int skipDevDest = -1, int skipDevFail = -1, const uint8_t *failData = nullptr) {
-		if (skipDevDest == -1)
-			skipDevDest = getParityDevByRow(row);
-		if (m_RAIDStatus == RAID_FAILED)
-			return false;
-		uint8_t tmpBuf[SECTOR_SIZE];
-		bool first = failData == nullptr;
-		if (!first)
-			mymemcpy(buf, failData, SECTOR_SIZE);
-		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
-			if (disk == skipDevDest || disk == skipDevFail)
+	/**
+	 * @brief: Checks the parity of rows [rowFrom, rowTo), which have to fit into m_stageRows rows
+	 * @param repair: recomputes the parity of a row that does not match from its data
+	 * @returns: The count of the rows that did not match, -1 when a device failed
+	 */
+	int scrubRows(int rowFrom, int rowTo, bool repair, uint8_t *stage) {
+		// the rows of cached stripes have to be on the devices first
+		if (!flushCache(stage, rowFrom, rowTo))
+			return -1;
+		STransfer transfers[MAX_RAID_DEVICES];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			transfers[disk] = STransfer(disk, rowFrom, stageSector(stage, disk, 0), rowTo - rowFrom);
+		transferAll(transfers, m_dev.m_Devices);
+		if (m_RAIDStatus != RAID_OK)
+			return -1;
+
+		int mismatches = 0;
+		for (int row = rowFrom; row < rowTo; ++row) {
+			const uint8_t *src[MAX_RAID_DEVICES];
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				src[disk] = stageSector(stage, disk, row - rowFrom);
+			uint64_t check[SECTOR_SIZE / sizeof(uint64_t)];
+			XORBlocks((uint8_t *)check, src, m_dev.m_Devices, SECTOR_SIZE);
+			uint64_t diff = 0;
+			for (uint64_t word : check)
+				diff |= word;
+			if (diff == 0)
 				continue;
-			if (first) {
-				first = false;
-				if (!readSector(disk, row, buf))
+			++mismatches;
+			if (!repair)
+				continue;
+			// a row can't tell which of its sectors is wrong, the data is taken as it is
+			int parityDisk = getParityDevByRow(row);
+			uint8_t *parity = stageSector(stage, parityDisk, row - rowFrom);
+			const uint8_t *data[MAX_RAID_DEVICES];
+			int dataCnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (disk != parityDisk)
+					data[dataCnt++] = src[disk];
+			XORBlocks(parity, data, dataCnt, SECTOR_SIZE);
+			if (!writeSector(parityDisk, row, parity))
+				return -1;
+		}
+		return mismatches;
+	}
+
+	/**
+	 * @brief: Recomputes rows [rowFrom, rowTo) of a device from all the other devices
+	 * @note: Every device gets one call per m_stageRows rows. Rows never written are zeroed without reading anything
+	 */
+	bool rebuildRows(int target, int rowFrom, int rowTo, uint8_t *stage) {
+		for (int chunkFrom = rowFrom; chunkFrom < rowTo;) {
+			int chunkTo = writtenRun(m_written, chunkFrom, chunkFrom + m_stageRows < rowTo ? chunkFrom + m_stageRows : rowTo);
+			int chunkRows = chunkTo - chunkFrom;
+			if (!isWritten(m_written, chunkFrom)) {
+				// a new disk does not have to be zero like the ones at create
+				for (int i = 0; i < chunkRows * SECTOR_SIZE; ++i)
+					stageSector(stage, target, 0)[i] = 0;
+				if (!writeSector(target, chunkFrom, stageSector(stage, target, 0), chunkRows))
 					return false;
-			} else {
-				if (!readSector(disk, row, tmpBuf))
+				chunkFrom = chunkTo;
+				continue;
+			}
+			STransfer transfers[MAX_RAID_DEVICES];
+			const uint8_t *src[MAX_RAID_DEVICES];
+			int srcCnt = 0;
+			for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+				if (disk != target)
+					transfers[srcCnt++] = STransfer(disk, chunkFrom, stageSector(stage, disk, 0), chunkRows);
+			transferAll(transfers, srcCnt);
+			for (int i = 0; i < srcCnt; ++i) {
+				if (!transfers[i].m_ok)
 					return false;
-				XORSector(buf, tmpBuf);
+				src[i] = transfers[i].m_buf;
 			}
+			XORBlocks(stageSector(stage, target, 0), src, srcCnt, chunkRows * SECTOR_SIZE);
+			if (!writeSector(target, chunkFrom, stageSector(stage, target, 0), chunkRows))
+				return false;
+			chunkFrom = chunkTo;
 		}
 		return true;
 	}
 
-	bool writeRAID_OK(int disk, int row, int parityDisk, const uint8_t *data) {
-		uint8_t newParity[SECTOR_SIZE];
-		if (!readSector(parityDisk, row, newParity))
-			return false;
-		uint8_t buf[SECTOR_SIZE];
-		if (!readSector(disk, row, buf))
-			return false;
+	/**
+	 * @brief: Reads volume sectors [secNr, secEnd), as many of them at once as fit into the staging buffer
+	 */
+	bool readRange(int secNr, int secEnd, const CSegments &data) {
+		int rowFrom, rowTo;
+		getRows(secNr, secEnd, rowFrom, rowTo);
+		CRangeGuard rangeGuard(m_rangeLock, rowFrom, rowTo, false);
+		CStage stage(m_stages);
+		for (int sector = secNr; sector < secEnd;) {
+			// as many sectors as fit into the staging buffer: whole stripes, or a part of a single chunk when even one stripe does not fit
+			int chunkEnd;
+			if (m_overhead.m_chunkSectors <= m_stageRows)
+				chunkEnd = (sector / stripeSectors() + m_stageRows / m_overhead.m_chunkSectors) * stripeSectors();
+			else {
+				chunkEnd = sector - sector % m_overhead.m_chunkSectors + m_overhead.m_chunkSectors;
+				chunkEnd = chunkEnd < sector + m_stageRows ? chunkEnd : sector + m_stageRows;
+			}
+			chunkEnd = chunkEnd < secEnd ? chunkEnd : secEnd;
+			if (!readChunk(sector, chunkEnd, data, stage))
+				return false; // m_RAIDStatus == RAID_FAILED
+			sector = chunkEnd;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief: Writes volume sectors [secNr, secEnd), whole stripes without reading anything
+	 * @param data: holds every sector of the range
+	 */
+	bool writeRange(int secNr, int secEnd, const CSegments &data) {
+		int rowFrom, rowTo;
+		getRows(secNr, secEnd, rowFrom, rowTo);
+		CRangeGuard rangeGuard(m_rangeLock, rowFrom, rowTo, true);
+		CStage stage(m_stages);
+		invalidateCheckpoint(rowFrom);
 
-		XORSector(newParity, buf);
-		XORSector(newParity, data);
+		int statusBefore = m_RAIDStatus;
+		// rows never written before this request don't have to be read
+		uint8_t written[SECTOR_SIZE];
+		snapshotWritten(written);
+		markWritten(rowFrom, rowTo);
+		markIntent(rowFrom, rowTo);
+		bool ok = true;
+		for (SAddress at = m_map.at(secNr); at.m_sector < secEnd && ok;) {
+			// the request covers whole stripes, no need to read anything
+			if (at.m_row == at.m_stripeRow && at.m_column == 0 && at.m_sector + stripeSectors() <= secEnd) {
+				int stripeTo = secEnd / stripeSectors();
+				ok = writeFullRows(at.m_row, stripeTo * m_overhead.m_chunkSectors, data, stage);
+				at = m_map.at(stripeTo * stripeSectors());
+				continue;
+			}
+			// a part of a stripe, every row of it gets all its new sectors at once
+			int partEnd = getSector(at.m_stripeRow + m_overhead.m_chunkSectors, 0);
+			partEnd = partEnd < secEnd ? partEnd : secEnd;
+			ok = writeStripePart(at, partEnd, data, written, stage);
+			at = m_map.at(partEnd);
+		}
+		// a disk dropped out during the write, it may have missed any part of it
+		if (statusBefore == RAID_OK && m_RAIDStatus == RAID_DEGRADED)
+			markIntent(rowFrom, rowTo);
+		return ok;
+	}
 
-		if (!writeSector(disk, row, data))
+	/**
+	 * @returns: True when the volume runs and every segment is inside it
+	 */
+	bool validSegments(const SIOVec *segs, int cnt) const {
+		if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
 			return false;
+		if (cnt < 0 || (cnt > 0 && !segs))
+			return false;
+		for (int i = 0; i < cnt; ++i)
+			if (segs[i].m_secNr < 0 || segs[i].m_secCnt < 0 || segs[i].m_secNr > size() - segs[i].m_secCnt || (segs[i].m_secCnt > 0 && !segs[i].m_data))
+				return false;
+		return true;
+	}
 
-		return writeSector(parityDisk, row, newParity);
+	/**
+	 * @returns: The end of the run of segments from first (not empty), each one at most maxGap sectors after the previous
+	 */
+	int segmentRun(const SIOVec *segs, int cnt, int first, int maxGap) const {
+		int end = segs[first].m_secNr + segs[first].m_secCnt;
+		int last = first + 1;
+		while (last < cnt && segs[last].m_secCnt > 0 && segs[last].m_secNr >= end && segs[last].m_secNr - end <= maxGap) {
+			end = segs[last].m_secNr + segs[last].m_secCnt;
+			++last;
+		}
+		return last;
 	}
 
 public:
 	/**
 	 * @brief: Writes initialization data to a potential RAID device
+	 * @param chunkSectors: sectors of a device in a stripe, large transfers get long runs, small ones a single device
+	 * @param layout: LAYOUT_LEFT_SYMMETRIC or LAYOUT_RIGHT_ASYMMETRIC
 	 * @returns: True when the device is valid and was successfully created
 	 */
-	static bool create(const TBlkDev &dev) {
+	static bool create(const TBlkDev &dev, int chunkSectors = DEFAULT_CHUNK_SECTORS, int layout = LAYOUT_LEFT_SYMMETRIC) {
 		// Check disk count
 		if (dev.m_Devices < 3 || dev.m_Devices > MAX_RAID_DEVICES)
 			return false;
+		// Check the layout, there has to be at least one stripe
+		if (chunkSectors < 1 || chunkSectors > MAX_CHUNK_SECTORS || dev.m_Sectors - OVERHEAD_SECTORS < chunkSectors)
+			return false;
+		if (layout != LAYOUT_LEFT_SYMMETRIC && layout != LAYOUT_RIGHT_ASYMMETRIC)
+			return false;
 		// Check if overhead can fit
 		if (sizeof(SOverhead) > SECTOR_SIZE)
 			return false;
 
-		uint8_t buf[SECTOR_SIZE];
+		uint8_t buf[OVERHEAD_SECTORS * SECTOR_SIZE];
+		for (int i = 0; i < OVERHEAD_SECTORS * SECTOR_SIZE; ++i)
+			buf[i] = 0;
 		{
-			SOverhead overhead(1, dev.m_Devices);
-			mymemcpy(buf, &overhead, sizeof(SOverhead));
+			// empty write-intent bitmap, then the overhead itself
+			SOverhead overhead(1, dev.m_Devices, chunkSectors, layout);
+			mymemcpy(buf + (OVERHEAD_SECTORS - 1) * SECTOR_SIZE, &overhead, sizeof(SOverhead));
 		}
 
 		bool err = false;
 
 		for (int disk = 0; disk < dev.m_Devices; ++disk)
-			if (dev.m_Write(disk, dev.m_Sectors - 1, buf, 1) != 1)
+			if (dev.m_Write(disk, dev.m_Sectors - OVERHEAD_SECTORS, buf, OVERHEAD_SECTORS) != OVERHEAD_SECTORS)
 				err = true; // even though I know an error occured, I still want to initialize rest of the devices, just in case
 
 		return !err;
 	}
 
-	CRaidVolume() : m_overhead() {
+	/**
+	 * @param cacheBytes: memory for the stripe cache, 0 writes every sector through
+	 * @param readAheadBytes: memory for the read-ahead of sequential reads, 0 turns it off
+	 */
+	CRaidVolume(int cacheBytes = CACHE_BYTES, int readAheadBytes = READAHEAD_BYTES) : m_overhead(), m_cacheBytes(cacheBytes), m_readAheadBytes(readAheadBytes) {
 		m_RAIDStatus = RAID_STOPPED;
+		m_rebuilding = -1;
+		m_rebuildCursor = 0;
+		m_rebuildDirtyOnly = false;
+		m_regionRows = 1;
+		m_intentSaved = false;
+		m_stageRows = 0;
 
 		m_hasDev = false;
 		m_dev.m_Devices = 0;
@@ -227,39 +2562,46 @@ public:
 		m_dev.m_Sectors = 0;
 		m_dev.m_Write = nullptr;
 	}
+	CRaidVolume(const CRaidVolume &) = delete;
+	CRaidVolume &operator=(const CRaidVolume &) = delete;
 
 	/**
 	 * @brief: Initializes a created or a stopped RAID
 	 * @returns: The status of the started RAID device
 	 */
 	int start(const TBlkDev &dev) {
+		CVolumeGuard volumeGuard(m_volumeLock, true);
 		if (m_RAIDStatus != RAID_STOPPED)
 			return m_RAIDStatus;
 		m_dev = TBlkDev(dev);
 		m_hasDev = true;
+		m_stageRows = STAGE_SECTORS / m_dev.m_Devices;
+		m_cache.init(m_cacheBytes / (m_dev.m_Devices * SECTOR_SIZE), m_dev.m_Devices);
+		m_readAhead.init(m_readAheadBytes / SECTOR_SIZE);
+#ifdef RAID_PARALLEL_IO
+		m_io.start(m_dev);
+#endif
 
 		// get the status of the device
-		int fail = 0;
+		// every overhead is read before any is trusted: a disk dropped in the middle of a rebuild is readable
+		// again, but its overhead is stale and may name a disk that is fine as failed
 		m_overhead = SOverhead(0, m_dev.m_Devices);
+		SOverhead loaded[MAX_RAID_DEVICES];
+		bool present[MAX_RAID_DEVICES];
+		int newest = -1;
 		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
-			SOverhead loaded;
-			if (!m_overhead.m_status.getStatus(disk) || !getOverhead(disk, loaded) || loaded.m_version == 0 || loaded.m_version < m_overhead.m_version) {
+			present[disk] = getOverhead(disk, loaded[disk]) && loaded[disk].m_version != 0;
+			if (present[disk] && (newest == -1 || loaded[disk].m_version > loaded[newest].m_version))
+				newest = disk;
+		}
+		int fail = 0;
+		if (newest != -1)
+			m_overhead = loaded[newest];
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (newest == -1 || !present[disk] || loaded[disk].m_version != m_overhead.m_version || !m_overhead.m_status.getStatus(disk)) {
 				m_overhead.m_status.setStatus(disk, false);
 				++fail;
-				continue;
-			}
-			if (loaded.m_version > m_overhead.m_version) {
-				// trust this overhead
-				m_overhead = loaded;
-				// set previous disks as failed - so don't trust
-				for (int prevDisk = 0; prevDisk < disk; ++prevDisk)
-					m_overhead.m_status.setStatus(prevDisk, false);
-				// calculate current count of successes and fails
-				fail = disk; // because disks from 0 to disk is failed
-				continue;
 			}
-			// success
-		}
 
 		// update version
 		// ? why do I want to do that?
@@ -269,7 +2611,7 @@ public:
 			int disk = 0;
 			while (disk < m_dev.m_Devices) {
 				if (m_overhead.m_status.getStatus(disk)) {
-					if (!setOverhead(disk)) {
+					if (!setOverhead(disk, m_overhead)) {
 						// I am so tired
 						m_overhead.m_status.setStatus(disk, false);
 						++m_overhead.m_version;
@@ -284,6 +2626,10 @@ public:
 		}
 		*/
 
+		// the layout is known only now
+		m_map.init(m_dev.m_Devices, m_overhead.m_chunkSectors, m_overhead.m_layout);
+		m_regionRows = (dataRows() + INTENT_REGIONS - 1) / INTENT_REGIONS;
+
 		if (fail == 0)
 			m_RAIDStatus = RAID_OK;
 		else if (fail == 1)
@@ -291,64 +2637,214 @@ public:
 		else
 			m_RAIDStatus = RAID_FAILED;
 
+		if (m_RAIDStatus == RAID_DEGRADED)
+			loadIntent();
+		else
+			m_overhead.m_intentDisk = -1;
+		loadWritten();
+
 		return m_RAIDStatus;
 	}
 
+	/**
+	 * @brief: Picks up the write-intent bitmap of the missing disk after start
+	 * @note: A disk that went missing only now still has the current version, so it only misses what comes next
+	 */
+	void loadIntent() {
+		int missing = 0;
+		while (m_overhead.m_status.getStatus(missing))
+			++missing;
+		if (m_overhead.m_intentDisk != missing) {
+			startIntent(missing, m_overhead.m_version);
+			return;
+		}
+		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
+			if (readSector(disk, m_dev.m_Sectors - INTENT_SECTOR_BACK, m_intent)) {
+				m_intentSaved = true;
+				return;
+			}
+		// no bitmap, the disk has to be rebuilt whole
+		m_overhead.m_intentDisk = -1;
+	}
+
 	/**
 	 * @brief: Stops a RAID device and writes overhead information to valid disks
 	 * @returns: RAID_STOPPED
 	 */
 	int stop() {
+		CVolumeGuard volumeGuard(m_volumeLock, true);
 		if (m_RAIDStatus == RAID_STOPPED)
 			return RAID_STOPPED;
-		++m_overhead.m_version;
-		for (int disk = 0; disk < m_dev.m_Devices; ++disk) {
-			if (m_overhead.m_status.getStatus(disk)) {
-				if (!setOverhead(disk)) {
-					// update overhead and start over
-					m_overhead.m_status.setStatus(disk, false);
-					return stop(); // ? potential point of optimalization: maybe reset for loop instead of recursion
-				}
-			}
+		flushCache(CStage(m_stages), 0, dataRows());
+		// the disks may change while stopped
+		m_cache.clear();
+		m_readAhead.reset();
+		// a rebuild in progress continues from its cursor after the next start
+		if (m_rebuilding != -1 && !m_rebuildDirtyOnly) {
+			m_overhead.m_rebuildRow = m_rebuildCursor;
+			saveCheckpoint();
 		}
+		// the overhead is going to name the missing disk, the bitmap on the disks has to be its own
+		if (m_RAIDStatus == RAID_DEGRADED && m_overhead.m_intentDisk != -1 && !m_intentSaved)
+			saveIntent();
+		flushOverhead();
+		m_rebuilding = -1;
+#ifdef RAID_PARALLEL_IO
+		m_io.stop();
+#endif
 		m_RAIDStatus = RAID_STOPPED;
 		return RAID_STOPPED;
 	}
 
+	/**
+	 * @brief: Rebuilds the missing disk in one go
+	 * @returns: RAID_OK when the disk is back, RAID_DEGRADED when it failed again
+	 */
 	int resync() {
+		return resyncStep(0);
+	}
+
+	/**
+	 * @brief: Rebuilds the missing disk a part at a time, reads and writes are served between the steps
+	 * @param maxRows: rows to rebuild in this call, 0 = all of them
+	 * @returns: RAID_OK once the disk is back, RAID_DEGRADED while rows are left or when the disk failed again
+	 * (resyncProgress tells which), RAID_FAILED or RAID_STOPPED when there is nothing to rebuild
+	 * @note: Rows below the rebuild cursor are read from the rebuilt disk, the rest is recovered from the others
+	 */
+	int resyncStep(int maxRows) {
+		CVolumeGuard volumeGuard(m_volumeLock, true);
 		if (m_RAIDStatus != RAID_DEGRADED)
 			return m_RAIDStatus;
+		CStage stage(m_stages);
+		// the rebuild reads the devices, they have to be up to date
+		if (!flushCache(stage, 0, dataRows()))
+			return m_RAIDStatus;
 
-		int toRecover = -1;
-		for (int disk = 0; disk < m_dev.m_Devices; ++disk)
-			if (!m_overhead.m_status.getStatus(disk)) {
-				toRecover = disk;
-				break;
-			}
-		if (toRecover == -1) {
-#ifndef __PROGTEST__
-			throw logic_error("RAID says degraded, but all disks are ok, which is not possible");
-#else
+		if (m_rebuilding == -1 && !beginRebuild())
 			return m_RAIDStatus;
-#endif
-		}
+		maxRows = maxRows > 0 ? maxRows : dataRows();
+		if (m_rebuildDirtyOnly)
+			rebuildDirty(maxRows, stage);
+		else
+			rebuildFull(maxRows, stage);
+		bool done = m_rebuilding != -1 && m_rebuildCursor >= dataRows();
+		// the disk missed the regions written since it dropped out, or never had the bitmap at all
+		if (done)
+			saveWritten();
 
-		m_overhead.m_status.setStatus(toRecover, true);
-		for (int row = 0; row < m_dev.m_Sectors - 1; ++row) {
-			uint8_t buf[SECTOR_SIZE];
-			if (!calculateParity(buf, row, toRecover)) {
-				// since we couldn't calculate the parity (other disk failed), then we can't resync anymore
-				markFailDisk(toRecover);
-				return RAID_FAILED;
-			}
-			if (!writeSector(toRecover, row, buf))
-				return RAID_DEGRADED;
+		if (m_rebuilding == -1)
+			return m_RAIDStatus;
+		if (m_RAIDStatus != RAID_DEGRADED) {
+			// since we couldn't calculate the parity (other disk failed), then we can't resync anymore
+			m_overhead.m_status.setStatus(m_rebuilding, false);
+			m_rebuilding = -1;
+			return m_RAIDStatus;
 		}
-
+		if (!done)
+			return RAID_DEGRADED;
+		m_rebuilding = -1;
+		m_overhead.m_rebuildDisk = -1;
+		m_overhead.m_intentDisk = -1;
 		m_RAIDStatus = RAID_OK;
 		return RAID_OK;
 	}
 
+	/**
+	 * @brief: How far the rebuild started by resyncStep got
+	 * @param done: rows rebuilt so far
+	 * @param total: rows the rebuild has to go through, only the dirty ones of a returning disk
+	 * @returns: False when no rebuild is in progress
+	 */
+	bool resyncProgress(int &done, int &total) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
+		done = total = 0;
+		if (m_rebuilding == -1)
+			return false;
+		if (!m_rebuildDirtyOnly) {
+			done = m_rebuildCursor;
+			total = dataRows();
+			return true;
+		}
+		CGuard guard(m_statusLock);
+		for (int row = 0; row < dataRows(); row += m_regionRows)
+			if (isDirty(row / m_regionRows)) {
+				int rows = row + m_regionRows < dataRows() ? m_regionRows : dataRows() - row;
+				total += rows;
+				done += row < m_rebuildCursor ? rows : 0;
+			}
+		return true;
+	}
+
+	/**
+	 * @brief: Writes every change still held in the stripe cache to the disks
+	 * @returns: False when the RAID is not running or failed
+	 */
+	bool flush() {
+		CVolumeGuard volumeGuard(m_volumeLock, true);
+		if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
+			return false;
+		return flushCache(CStage(m_stages), 0, dataRows());
+	}
+
+	/**
+	 * @brief: Copies the I/O statistics of the devices, counted since the volume was constructed or resetStats()
+	 * @note: The counters are read one by one, a snapshot taken during I/O may mix a call into some of them only
+	 */
+	void stats(SRaidStats &out) const {
+		m_stats.snapshot(out, m_dev.m_Devices);
+	}
+
+	void resetStats() {
+		m_stats.reset();
+	}
+
+	/**
+	 * @brief: Checks that the parity matches the data, continues the pass where the last call stopped (even after a restart)
+	 * @param maxRows: rows to check in this call, 0 = the rest of the pass; smaller calls spread a pass over time
+	 * @param repair: rewrites the parity of the rows that do not match
+	 * @param mismatches: the count of the rows that did not match is added to it
+	 * @returns: The rows left in the pass, 0 once it finished (the next call starts over), -1 when the RAID is not RAID_OK
+	 * @note: Every device is read m_stageRows rows at a time, only those rows are locked away from writes
+	 */
+	int scrub(int maxRows, bool repair, int &mismatches) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
+		if (m_RAIDStatus != RAID_OK)
+			return -1;
+		CStage stage(m_stages);
+		int row;
+		{
+			CGuard guard(m_statusLock);
+			row = m_overhead.m_scrubRow < dataRows() ? m_overhead.m_scrubRow : 0;
+		}
+		int rowTo = maxRows > 0 && row + maxRows < dataRows() ? row + maxRows : dataRows();
+		bool ok = true;
+		uint8_t written[SECTOR_SIZE];
+		while (row < rowTo && ok) {
+			snapshotWritten(written);
+			int chunkTo = writtenRun(written, row, row + m_stageRows < rowTo ? row + m_stageRows : rowTo);
+			// rows never written are zero everywhere, there is nothing to check
+			if (isWritten(written, row)) {
+				CRangeGuard rangeGuard(m_rangeLock, row, chunkTo, repair);
+				int found = scrubRows(row, chunkTo, repair, stage);
+				ok = found != -1;
+				mismatches += ok ? found : 0;
+			}
+			if (!ok)
+				break;
+			// the cursor is saved now and then, not after every read
+			bool checkpoint = chunkTo == dataRows() || chunkTo == rowTo || chunkTo / CHECKPOINT_ROWS != row / CHECKPOINT_ROWS;
+			row = chunkTo;
+			if (checkpoint) {
+				CGuard guard(m_statusLock);
+				m_overhead.m_scrubRow = row == dataRows() ? 0 : row;
+				flushOverhead();
+			}
+		}
+		if (!ok)
+			return -1;
+		return row == dataRows() ? 0 : dataRows() - row;
+	}
+
 	/**
 	 * @return: The current status of the RAID device
 	 */
@@ -360,71 +2856,112 @@ public:
 	 * @return: The ammount of sectors available to tester
 	 */
 	int size() const {
-		// m_dev.m_Sectors - 1: all sectors of singular device, except one for overhead
+		// dataRows(): all sectors of singular device, except the ones for overhead
 		// m_dev.m_Devices - 1: all devices, except one for parity
-		return m_hasDev && (m_RAIDStatus == RAID_OK || m_RAIDStatus == RAID_DEGRADED) ? (m_dev.m_Sectors - 1) * (m_dev.m_Devices - 1) : 0;
+		return m_hasDev && (m_RAIDStatus == RAID_OK || m_RAIDStatus == RAID_DEGRADED) ? dataRows() * (m_dev.m_Devices - 1) : 0;
 	}
 
+	/**
+	 * @note: With RAID_THREAD_SAFE reads and writes may be called from several threads at once
+	 */
 	bool read(int secNr, void *data, int secCnt) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
 		if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
 			return false;
-		for (int secD = 0; secD < secCnt; ++secD) {
-			int disk = getDevice(secNr + secD);
-			int row = getRow(secNr + secD);
-			// int parityDisk = getParityDevByRow(row);
-			uint8_t *currentData = (uint8_t *)data + (secD * SECTOR_SIZE);
-
-			if (m_RAIDStatus == RAID_OK) {
-				if (readSector(disk, row, currentData))
-					continue;
-			}
-			if (m_RAIDStatus == RAID_DEGRADED) {
-				if (m_overhead.m_status.getStatus(disk) && readSector(disk, row, currentData))
-					continue;
-				else if (calculateParity(currentData, row, disk)) // inverse of xor is xor, recover data that way
-					continue;
-			}
-			// m_RAIDStatus == RAID_FAILED
+		if (secNr < 0 || secCnt < 0 || secNr + secCnt > size())
 			return false;
+		if (secCnt == 0)
+			return true;
+		int secEnd = secNr + secCnt;
+		if (m_readAhead.capacity() > 0) {
+			CGuard guard(m_readAheadLock);
+			if (m_readAhead.sequential(secNr, secCnt) && 2 * secCnt <= m_readAhead.capacity()) {
+				if (m_readAhead.find(secNr, secCnt, (uint8_t *)data))
+					return true;
+				int to = secNr + m_readAhead.window(secCnt);
+				to = to < size() ? to : size();
+				// whole stripes, unless the request itself ends in the middle of one
+				if (to / stripeSectors() * stripeSectors() >= secEnd)
+					to = to / stripeSectors() * stripeSectors();
+				SIOVec ahead = {secNr, m_readAhead.buffer(), to - secNr};
+				if (!readRange(secNr, to, CSegments(&ahead, 1))) {
+					m_readAhead.filled(0, 0);
+					return false;
+				}
+				m_readAhead.filled(secNr, to);
+				return m_readAhead.find(secNr, secCnt, (uint8_t *)data);
+			}
 		}
-		return true;
+		SIOVec seg = {secNr, data, secCnt};
+		return readRange(secNr, secEnd, CSegments(&seg, 1));
 	}
 
 	bool write(int secNr, const void *data, int secCnt) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
 		if (m_RAIDStatus != RAID_OK && m_RAIDStatus != RAID_DEGRADED)
 			return false;
+		if (secNr < 0 || secCnt < 0 || secNr + secCnt > size())
+			return false;
+		if (secCnt == 0)
+			return true;
+		int secEnd = secNr + secCnt;
+		SIOVec seg = {secNr, const_cast<void *>(data), secCnt};
+		bool ok = writeRange(secNr, secEnd, CSegments(&seg, 1));
+		// once the rows are free again, a reader could be waiting for them with the read-ahead lock
+		if (m_readAhead.capacity() > 0) {
+			CGuard guard(m_readAheadLock);
+			m_readAhead.drop(secNr, secEnd);
+		}
+		return ok;
+	}
 
-		for (int secD = 0; secD < secCnt; ++secD) {
-			int disk = getDevice(secNr + secD);
-			int row = getRow(secNr + secD);
-			int parityDisk = getParityDevByRow(row);
-			const uint8_t *currentData = (const uint8_t *)data + (secD * SECTOR_SIZE);
-
-			if (m_RAIDStatus == RAID_OK) {
-				if (writeRAID_OK(disk, row, parityDisk, currentData))
-					continue;
+	/**
+	 * @brief: Reads a list of segments, the ones that follow each other (less than a stripe apart) as a single request
+	 * @returns: False when a segment is outside of the volume, nothing is read then, or when a device failed
+	 * @note: The sectors go from the staging buffers straight to the segments, every device gets one call per
+	 * m_stageRows rows of a run. The read-ahead is left to read
+	 */
+	bool readv(const SIOVec *segs, int cnt) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
+		if (!validSegments(segs, cnt))
+			return false;
+		for (int first = 0; first < cnt;) {
+			if (segs[first].m_secCnt == 0) {
+				++first;
+				continue;
 			}
-			if (m_RAIDStatus == RAID_DEGRADED) {
-				// multiple ways to do this
-				if (!m_overhead.m_status.getStatus(disk)) {
-					// disk is failed
-					// only update parity
-					uint8_t newParity[SECTOR_SIZE];
-					if (calculateParity(newParity, row, parityDisk, disk, currentData) && writeSector(parityDisk, row, newParity))
-						continue;
+			int last = segmentRun(segs, cnt, first, stripeSectors());
+			if (!readRange(segs[first].m_secNr, segs[last - 1].m_secNr + segs[last - 1].m_secCnt, CSegments(segs + first, last - first)))
+				return false;
+			first = last;
+		}
+		return true;
+	}
 
-				} else if (!m_overhead.m_status.getStatus(parityDisk)) {
-					// parity is failed
-					if (writeSector(disk, row, currentData))
-						continue;
-				} else {
-					// both ok
-					if (writeRAID_OK(disk, row, parityDisk, currentData))
-						continue;
-				}
-			}
-			// m_RAIDSTATUS == RAID_FAILED
+	/**
+	 * @brief: Writes a list of segments in their order, the ones right after each other as a single request
+	 * @returns: False when a segment is outside of the volume, nothing is written then, or when a device failed
+	 * @note: A run covering whole stripes writes them without reading anything, like a large write
+	 */
+	bool writev(const SIOVec *segs, int cnt) {
+		CVolumeGuard volumeGuard(m_volumeLock, false);
+		if (!validSegments(segs, cnt))
 			return false;
+		for (int first = 0; first < cnt;) {
+			if (segs[first].m_secCnt == 0) {
+				++first;
+				continue;
+			}
+			int last = segmentRun(segs, cnt, first, 0);
+			int secNr = segs[first].m_secNr, secEnd = segs[last - 1].m_secNr + segs[last - 1].m_secCnt;
+			bool ok = writeRange(secNr, secEnd, CSegments(segs + first, last - first));
+			if (m_readAhead.capacity() > 0) {
+				CGuard guard(m_readAheadLock);
+				m_readAhead.drop(secNr, secEnd);
+			}
+			if (!ok)
+				return false;
+			first = last;
 		}
 		return true;
 	}